@@ -0,0 +1,530 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include "async.h"
+#include "stats.h"
+#include "razer_trace.h"
+
+/**
+ * Hands the packet in async->buf to the transport, either to send it or to
+ * read the response into it
+ *
+ * Must be called with async->lock held
+ */
+static int razer_async_submit(struct razer_async *async, bool get)
+{
+    int rc;
+
+    if (get) {
+        memset(async->buf, 0, RAZER_USB_REPORT_LEN);
+    }
+    async->submitted = ktime_get();
+    async->transfers++;
+    async->in_flight = true;
+    async->timed_out = false;
+    hrtimer_start(&async->watchdog_timer, ms_to_ktime(RAZER_TRANSFER_TIMEOUT_MS), HRTIMER_MODE_REL_SOFT);
+    rc = async->transport->submit(async, get);
+    if (rc) {
+        async->in_flight = false;
+        hrtimer_try_to_cancel(&async->watchdog_timer);
+    }
+    return rc;
+}
+
+/**
+ * The transfer in flight took too long. It is unlinked, and ends with
+ * -ETIMEDOUT like any other failed transfer
+ */
+static enum hrtimer_restart razer_async_watchdog(struct hrtimer *timer)
+{
+    struct razer_async *async = container_of(timer, struct razer_async, watchdog_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    // Unless it ended while we were waiting for the lock. The transfer in
+    // flight may then already be the next one, which hasn't had its time yet
+    if (async->in_flight && !async->timed_out &&
+        ktime_ms_delta(ktime_get(), async->submitted) >= RAZER_TRANSFER_TIMEOUT_MS) {
+        async->timed_out = true;
+        async->transport->unlink(async);
+    }
+    spin_unlock_irqrestore(&async->lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+static void razer_async_start_timer(struct razer_async *async, unsigned int us)
+{
+    async->timer_started = ktime_get();
+    hrtimer_start(&async->spacing_timer, ns_to_ktime((__u64) us * NSEC_PER_USEC), HRTIMER_MODE_REL_SOFT);
+}
+
+/**
+ * Gives a command the next transaction id, so its response can be told apart
+ * from a stale one. The device part of the id is kept, the crc doesn't cover it.
+ * Commands keep the id they were built with if the EC doesn't echo ours
+ *
+ * Must be called with async->lock held
+ */
+static void razer_async_stamp(struct razer_async *async, struct razer_command *command)
+{
+    if (!async->echo_transaction) {
+        return;
+    }
+    command->request.transaction_id.parts.id = async->next_transaction;
+    async->next_transaction = (async->next_transaction + 1) & 0x1f;
+}
+
+bool razer_async_response_matches(struct razer_async *async, const struct razer_packet *request,
+                                  const struct razer_packet *response)
+{
+    return (!READ_ONCE(async->echo_transaction) || response->transaction_id.id == request->transaction_id.id) &&
+           response->command_class == request->command_class &&
+           response->command_id.id == request->command_id.id;
+}
+
+/**
+ * Hands the current command back to its sender
+ *
+ * Must be called with async->lock held
+ */
+static void razer_async_finish_command(struct razer_async *async, int result)
+{
+    struct razer_command *command = async->current_command;
+
+    async->current_command = NULL;
+    command->result = result;
+    complete(&command->done);
+}
+
+/**
+ * Picks the next packet and submits it. Queued commands go first, by priority
+ * class. Rows always go out before the display packet, so the EC never shows
+ * a half uploaded frame.
+ *
+ * Must be called with async->lock held
+ */
+static void razer_async_submit_next(struct razer_async *async)
+{
+    struct razer_command *command = NULL;
+    struct razer_packet *packet;
+    int prio;
+    int row;
+    int rc;
+
+    if (async->busy) {
+        return;
+    }
+    if (async->halted) {
+        wake_up_all(&async->idle_wait);
+        return;
+    }
+
+    for (prio = 0; prio < RAZER_PRIO_FRAME; prio++) {
+        command = list_first_entry_or_null(&async->commands[prio], struct razer_command, node);
+        if (command) {
+            list_del(&command->node);
+            async->queued[prio]--;
+            break;
+        }
+    }
+
+    row = find_first_bit(&async->pending_rows, RAZER_MATRIX_ROWS);
+    if (command) {
+        razer_async_stamp(async, command);
+        command->state = RAZER_COMMAND_SENDING;
+        async->current_command = command;
+        packet = &command->request;
+    } else if (row < RAZER_MATRIX_ROWS) {
+        clear_bit(row, &async->pending_rows);
+        packet = &async->rows[row];
+    } else if (async->pending_display) {
+        async->pending_display = false;
+        packet = &async->display;
+    } else {
+        wake_up_all(&async->idle_wait);
+        return;
+    }
+
+    memcpy(async->buf, packet, RAZER_USB_REPORT_LEN);
+    async->busy = true;
+    rc = razer_async_submit(async, false);
+    if (rc) {
+        dev_warn(&async->usb_dev->dev, "Razer laptop control: Failed to submit packet (%d)", rc);
+        if (command) {
+            razer_async_finish_command(async, rc);
+        }
+        async->busy = false;
+    }
+    // Someone might be waiting for room in the queue we took from
+    wake_up_all(&async->idle_wait);
+}
+
+/**
+ * Handles the response of the current command. Returns true if the command
+ * isn't done yet: the EC was still busy and will be asked again after a
+ * backoff, or the response was lost and the command has been sent again
+ *
+ * Must be called with async->lock held
+ */
+static bool razer_async_command_response(struct razer_async *async, int status, int actual_length)
+{
+    struct razer_command *command = async->current_command;
+    bool valid = status == 0 && actual_length == RAZER_USB_REPORT_LEN;
+
+    memcpy(&command->response, async->buf, RAZER_USB_REPORT_LEN);
+    if (status == 0 && !valid) {
+        dev_warn(&async->usb_dev->dev, "Razer laptop control: USB Response invalid. Got %d bytes. Expected 90.", actual_length);
+    }
+    if (valid && !razer_async_response_matches(async, &command->request, &command->response) &&
+        command->resends < RAZER_LOST_RETRIES) {
+        // This is the answer to some other packet, ours got lost. Send it
+        // again under a new transaction id
+        razer_async_stamp(async, command);
+        command->state = RAZER_COMMAND_SENDING;
+        command->resends++;
+        memcpy(async->buf, &command->request, RAZER_USB_REPORT_LEN);
+        if (razer_async_submit(async, false) == 0) {
+            return true;
+        }
+        razer_async_finish_command(async, -EIO);
+        return false;
+    }
+    if (valid && command->response.status == RAZER_CMD_BUSY && command->retries < RAZER_BUSY_RETRIES) {
+        // The EC is still working on it, ask again a little later
+        command->state = RAZER_COMMAND_BACKOFF;
+        razer_async_start_timer(async, RAZER_BUSY_BACKOFF_US << command->retries);
+        command->retries++;
+        return true;
+    }
+    razer_async_finish_command(async, status ? status : (valid ? 0 : -EIO));
+    return false;
+}
+
+void razer_async_transfer_done(struct razer_async *async, int status, int actual_length)
+{
+    struct razer_command *command;
+    unsigned long flags;
+    __u64 elapsed = ktime_to_ns(ktime_sub(ktime_get(), async->submitted));
+
+    spin_lock_irqsave(&async->lock, flags);
+    async->in_flight = false;
+    hrtimer_try_to_cancel(&async->watchdog_timer);
+    if (async->timed_out && (status == -ECONNRESET || status == -ENOENT)) {
+        status = -ETIMEDOUT;
+    }
+    command = async->current_command;
+    if (!command) {
+        // Frame packets, killed ones too
+        if (((struct razer_packet *) async->buf)->command_id.id == 0x0b) {
+            trace_razer_frame_row((struct razer_packet *) async->buf, status, elapsed);
+        } else {
+            trace_razer_frame_display((struct razer_packet *) async->buf, status, elapsed);
+        }
+    }
+    switch (status) {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+    case -ENODEV:
+        // Transfer was killed, don't bother with the spacing
+        if (command) {
+            razer_async_finish_command(async, status);
+        }
+        async->busy = false;
+        wake_up_all(&async->idle_wait);
+        spin_unlock_irqrestore(&async->lock, flags);
+        return;
+    default:
+        dev_warn(&async->usb_dev->dev, "Razer laptop control: Device data transfer failed (%d)", status);
+        break;
+    }
+
+    if (!command) {
+        // Commands are counted by their sender, once the exchange is over
+        razer_stats_record(async->stats, (struct razer_packet *) async->buf, 0, status, false,
+                           elapsed, actual_length);
+    } else {
+        command->usb_ns += elapsed;
+        if (command->state != RAZER_COMMAND_SENDING) {
+            if (!razer_async_command_response(async, status, actual_length)) {
+                // The EC has answered, so it is ready for the next packet
+                async->busy = false;
+                razer_async_submit_next(async);
+            }
+            spin_unlock_irqrestore(&async->lock, flags);
+            return;
+        }
+        if (status) {
+            razer_async_finish_command(async, status);
+        }
+    }
+    // The EC ignores packets that arrive too quickly, and needs the time to
+    // get the response ready, so hold the next packet back
+    razer_async_start_timer(async, READ_ONCE(async->pacing->spacing_us));
+    spin_unlock_irqrestore(&async->lock, flags);
+}
+
+static enum hrtimer_restart razer_async_spacing_done(struct hrtimer *timer)
+{
+    struct razer_async *async = container_of(timer, struct razer_async, spacing_timer);
+    struct razer_command *command;
+    unsigned long flags;
+    int rc;
+
+    spin_lock_irqsave(&async->lock, flags);
+    command = async->current_command;
+    if (command) {
+        // Time to ask for the response
+        command->sleep_ns += ktime_to_ns(ktime_sub(ktime_get(), async->timer_started));
+        command->state = RAZER_COMMAND_RECEIVING;
+        rc = razer_async_submit(async, true);
+        if (rc == 0) {
+            spin_unlock_irqrestore(&async->lock, flags);
+            return HRTIMER_NORESTART;
+        }
+        dev_warn(&async->usb_dev->dev, "Razer laptop control: Failed to submit packet (%d)", rc);
+        razer_async_finish_command(async, rc);
+    }
+    async->busy = false;
+    razer_async_submit_next(async);
+    spin_unlock_irqrestore(&async->lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+static bool razer_async_idle(struct razer_async *async)
+{
+    unsigned long flags;
+    bool idle;
+
+    spin_lock_irqsave(&async->lock, flags);
+    idle = !async->busy;
+    spin_unlock_irqrestore(&async->lock, flags);
+    return idle;
+}
+
+int razer_async_init(struct razer_async *async, struct usb_device *usb_dev, const struct razer_transport_ops *transport,
+                     const struct razer_pacing *pacing, struct razer_stats *stats)
+{
+    int prio;
+    int rc;
+
+    spin_lock_init(&async->lock);
+    init_waitqueue_head(&async->idle_wait);
+    hrtimer_init(&async->spacing_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    async->spacing_timer.function = razer_async_spacing_done;
+    hrtimer_init(&async->watchdog_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    async->watchdog_timer.function = razer_async_watchdog;
+    async->in_flight = false;
+    async->timed_out = false;
+    async->transport = transport;
+    async->usb_dev = usb_dev;
+    async->pacing = pacing;
+    async->stats = stats;
+    async->busy = false;
+    async->halted = 0;
+    async->current_command = NULL;
+    async->next_transaction = 0;
+    async->echo_transaction = false;
+    async->transfers = 0;
+    async->allocations = 0;
+    for (prio = 0; prio < RAZER_PRIO_FRAME; prio++) {
+        INIT_LIST_HEAD(&async->commands[prio]);
+        async->queued[prio] = 0;
+    }
+    async->pending_rows = 0;
+    async->pending_display = false;
+
+    // Every transfer is done out of this one buffer, nothing is allocated per packet
+    async->buf = kzalloc(RAZER_USB_REPORT_LEN, GFP_KERNEL);
+    if (!async->buf) {
+        return -ENOMEM;
+    }
+    async->allocations++;
+    rc = transport->init(async);
+    if (rc) {
+        kfree(async->buf);
+        return rc;
+    }
+    return 0;
+}
+
+void razer_async_destroy(struct razer_async *async)
+{
+    struct razer_command *command, *next;
+    unsigned long flags;
+    int prio;
+
+    razer_async_halt(async);
+    async->transport->kill(async);
+    hrtimer_cancel(&async->watchdog_timer);
+    hrtimer_cancel(&async->spacing_timer);
+
+    // Nobody is going to send these anymore
+    spin_lock_irqsave(&async->lock, flags);
+    if (async->current_command) {
+        razer_async_finish_command(async, -ENODEV);
+    }
+    for (prio = 0; prio < RAZER_PRIO_FRAME; prio++) {
+        list_for_each_entry_safe(command, next, &async->commands[prio], node) {
+            list_del(&command->node);
+            command->result = -ENODEV;
+            complete(&command->done);
+        }
+        async->queued[prio] = 0;
+    }
+    spin_unlock_irqrestore(&async->lock, flags);
+
+    async->transport->destroy(async);
+    kfree(async->buf);
+}
+
+enum razer_priority razer_async_classify(const struct razer_packet *packet)
+{
+    switch (packet->command_class) {
+    case 0x0d: // Fan and power
+        return RAZER_PRIO_THERMAL;
+    case 0x03:
+        if (packet->command_id.id == 0x0a || packet->command_id.id == 0x0b) {
+            return RAZER_PRIO_FRAME; // Matrix display and rows
+        }
+        return RAZER_PRIO_CONTROL; // Brightness
+    default:
+        return RAZER_PRIO_CONTROL;
+    }
+}
+
+static bool razer_async_has_room(struct razer_async *async, enum razer_priority prio)
+{
+    unsigned long flags;
+    bool room;
+
+    spin_lock_irqsave(&async->lock, flags);
+    room = async->queued[prio] < RAZER_COMMAND_QUEUE_DEPTH;
+    spin_unlock_irqrestore(&async->lock, flags);
+    return room;
+}
+
+int razer_async_exchange(struct razer_async *async, struct razer_command *command)
+{
+    enum razer_priority prio = razer_async_classify(&command->request);
+    unsigned long flags;
+
+    // A frame packet sent through here wants its response, so it queues
+    // like any other command
+    if (prio == RAZER_PRIO_FRAME) {
+        prio = RAZER_PRIO_CONTROL;
+    }
+    init_completion(&command->done);
+    command->result = 0;
+    command->retries = 0;
+    command->resends = 0;
+    command->usb_ns = 0;
+    command->sleep_ns = 0;
+    memset(&command->response, 0, sizeof(command->response));
+
+    spin_lock_irqsave(&async->lock, flags);
+    while (async->queued[prio] >= RAZER_COMMAND_QUEUE_DEPTH) {
+        spin_unlock_irqrestore(&async->lock, flags);
+        wait_event(async->idle_wait, razer_async_has_room(async, prio));
+        spin_lock_irqsave(&async->lock, flags);
+    }
+    list_add_tail(&command->node, &async->commands[prio]);
+    async->queued[prio]++;
+    razer_async_submit_next(async);
+    spin_unlock_irqrestore(&async->lock, flags);
+
+    wait_for_completion(&command->done);
+    return command->result;
+}
+
+int razer_async_check_echo(struct razer_async *async)
+{
+    struct razer_command command;
+    unsigned long flags;
+    bool echo;
+    int rc;
+
+    // Power mode of zone 1, every EC answers that. Ids aren't stamped yet, so
+    // it goes out with 0x3f, an id other Razer devices are sent as well
+    command.request = get_razer_report(0x0d, 0x82, 0x04);
+    command.request.args[1] = 0x01;
+    command.request.transaction_id.id = 0x3f;
+    command.request.crc = crc(&command.request);
+    rc = razer_async_exchange(async, &command);
+    echo = rc == 0 && command.response.status == RAZER_CMD_SUCCESSFUL &&
+           command.response.transaction_id.id == command.request.transaction_id.id;
+
+    spin_lock_irqsave(&async->lock, flags);
+    async->echo_transaction = echo;
+    spin_unlock_irqrestore(&async->lock, flags);
+    if (!echo) {
+        dev_info(&async->usb_dev->dev, "Razer laptop control: EC doesn't echo transaction ids, responses are matched by command");
+    }
+    return rc;
+}
+
+void razer_async_queue_row(struct razer_async *async, int row, struct razer_packet *packet)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    trace_razer_frame_queue_row(packet, test_bit(row, &async->pending_rows));
+    async->rows[row] = *packet;
+    set_bit(row, &async->pending_rows);
+    razer_async_submit_next(async);
+    spin_unlock_irqrestore(&async->lock, flags);
+}
+
+bool razer_async_row_pending(struct razer_async *async, int row)
+{
+    unsigned long flags;
+    bool pending;
+
+    spin_lock_irqsave(&async->lock, flags);
+    pending = test_bit(row, &async->pending_rows);
+    spin_unlock_irqrestore(&async->lock, flags);
+    return pending;
+}
+
+void razer_async_queue_display(struct razer_async *async, struct razer_packet *packet)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    trace_razer_frame_queue_display(packet, async->pending_display);
+    async->display = *packet;
+    async->pending_display = true;
+    razer_async_submit_next(async);
+    spin_unlock_irqrestore(&async->lock, flags);
+}
+
+void razer_async_cancel_frame(struct razer_async *async)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    async->pending_rows = 0;
+    async->pending_display = false;
+    spin_unlock_irqrestore(&async->lock, flags);
+}
+
+void razer_async_halt(struct razer_async *async)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    async->halted++;
+    spin_unlock_irqrestore(&async->lock, flags);
+    wait_event(async->idle_wait, razer_async_idle(async));
+}
+
+void razer_async_resume(struct razer_async *async)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&async->lock, flags);
+    async->halted--;
+    razer_async_submit_next(async);
+    spin_unlock_irqrestore(&async->lock, flags);
+}
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+#include "core.h"
+
+// USB control transfers to the EC
+extern const struct razer_transport_ops razer_usb_transport;
+
+// EC simulated in the driver, see fake_ec.c
+extern const struct razer_transport_ops razer_fake_ec_transport;
+
+/**
+ * Returns the number of packets the simulated EC has taken. Packets it ignored
+ * because they came too soon are not counted
+ */
+unsigned int razer_fake_ec_packets(struct razer_async *async);
+
+/**
+ * Allocates the buffers used by the engine and sets up the transport
+ * @param usb_dev EC Controller USB device struct
+ * @param transport How packets get to the EC
+ * @param pacing Packet spacing to honour between packets
+ * @param stats Statistics the sent packets are counted in
+ */
+int razer_async_init(struct razer_async *async, struct usb_device *usb_dev, const struct razer_transport_ops *transport,
+                     const struct razer_pacing *pacing, struct razer_stats *stats);
+
+/**
+ * Stops the engine, waits for the packet in flight and frees everything
+ */
+void razer_async_destroy(struct razer_async *async);
+
+/**
+ * Called by the transport once a transfer it was handed is over
+ * @param status 0, or why the transfer failed (-ENOENT etc. if it was killed)
+ * @param actual_length Bytes transferred
+ */
+void razer_async_transfer_done(struct razer_async *async, int status, int actual_length);
+
+/**
+ * Returns the priority class a packet is sent with
+ */
+enum razer_priority razer_async_classify(const struct razer_packet *packet);
+
+/**
+ * Queues a command in its priority class and waits for the EC's response.
+ * Waits for room first if the queue of the class is full
+ * @return 0 once the response is in command->response, else why it failed
+ */
+int razer_async_exchange(struct razer_async *async, struct razer_command *command);
+
+/**
+ * Returns true if a response answers the request: same class and command, and
+ * the same transaction if the EC echoes ours
+ */
+bool razer_async_response_matches(struct razer_async *async, const struct razer_packet *request,
+                                  const struct razer_packet *response);
+
+/**
+ * Finds out if the EC echoes the transaction id of a request. Until it is
+ * known to, every command keeps the fixed id it was built with, and responses
+ * are matched by class and command only. Called once at probe
+ * @return 0, or why the exchange failed (ids are then left alone)
+ */
+int razer_async_check_echo(struct razer_async *async);
+
+/**
+ * Stages a matrix row packet. Replaces the packet of the same row if it has
+ * not been sent yet
+ */
+void razer_async_queue_row(struct razer_async *async, int row, struct razer_packet *packet);
+
+/**
+ * Returns true if the staged packet of a row has not been sent yet
+ */
+bool razer_async_row_pending(struct razer_async *async, int row);
+
+/**
+ * Stages the packet that tells the EC to display the uploaded rows. It is
+ * always sent after every staged row
+ */
+void razer_async_queue_display(struct razer_async *async, struct razer_packet *packet);
+
+/**
+ * Drops every staged row and display packet that hasn't been sent yet
+ */
+void razer_async_cancel_frame(struct razer_async *async);
+
+/**
+ * Stops the engine from submitting anything new and waits until the packet in
+ * flight (and its spacing) is done. Used on suspend and teardown, so nothing
+ * reaches the EC until razer_async_resume
+ */
+void razer_async_halt(struct razer_async *async);
+
+/**
+ * Lets the engine send whatever was staged while it was halted
+ */
+void razer_async_resume(struct razer_async *async);
+
+#endif
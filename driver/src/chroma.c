@@ -1,40 +1,304 @@
 #include "chroma.h"
 
-struct row_data matrix[5];
+int razer_fb_init(struct razer_framebuffer *fb) {
+    // Zeroed and page aligned, so it can be mapped to userspace as it is
+    fb->mem = vmalloc_user(RAZER_FB_SIZE);
+    if (fb->mem == NULL) {
+        return -ENOMEM;
+    }
+    fb->back = 0;
+    fb->valid = false;
+    return 0;
+}
+
+void razer_fb_destroy(struct razer_framebuffer *fb) {
+    vfree(fb->mem);
+    fb->mem = NULL;
+}
+
+__u8 *razer_fb_back(struct razer_framebuffer *fb) {
+    return fb->mem + fb->back * PAGE_SIZE;
+}
 
+__u8 *razer_fb_front(struct razer_framebuffer *fb) {
+    return fb->mem + (fb->back ^ 1) * PAGE_SIZE;
+}
 
-int displayMatrix(struct usb_device *usb) {
+int displayMatrix(struct razer_laptop *laptop) {
     int row;
-    for (row=0; row<=5; row++) {
-        sendRowDataToProfile(usb, row);
+    for (row = 0; row < RAZER_MATRIX_ROWS; row++) {
+        sendRowDataToProfile(laptop, row);
     }
     return 0;
 }
 
-int sendRowDataToProfile(struct usb_device *usb, int row_number) {
+int sendRowDataToProfile(struct razer_laptop *laptop, int row_number) {
+    return sendRowSpanToProfile(laptop, row_number, 0, 14);
+}
+
+/*
+ * The EC's rows are 16 columns wide. Column 0 has no LED, so key n of a row
+ * lives in column n + 1. Colours start at args[4] with the start column.
+ * A span starting at the first key also covers column 0, which keeps full row
+ * packets identical to the ones this driver has always sent.
+ */
+int sendRowSpanToProfile(struct razer_laptop *laptop, int row_number, int start_key, int end_key) {
     struct razer_packet packet = {0};
-    packet = get_razer_report(0x03, 0x0b, 0x34);
+    __u8 *row_data = razer_fb_front(&laptop->fb) + row_number * 45;
+    int start_col = start_key == 0 ? 0 : start_key + 1;
+    int end_col = end_key + 1;
+    int key_count = end_key - start_key + 1;
+
+    packet = get_razer_report(0x03, 0x0b, 4 + (end_col - start_col + 1) * 3);
 
     packet.args[0] = 0xff;
     packet.args[1] = row_number;
-    packet.args[3] = 0x0f;
-    memcpy(&packet.args[7], &matrix[row_number].keys, 45);
-    send_payload(usb, &packet);
+    packet.args[2] = start_col;
+    packet.args[3] = end_col;
+    memcpy(&packet.args[4 + (start_key + 1 - start_col) * 3], &row_data[start_key * 3], key_count * 3);
+    packet.crc = crc(&packet);
+    razer_async_queue_row(&laptop->async, row_number, &packet);
+    laptop->fb.staged_start[row_number] = start_key;
+    laptop->fb.staged_end[row_number] = end_key;
+
+    return 0;
+}
 
+int flipMatrixFrame(struct razer_laptop *laptop) {
+    struct razer_framebuffer *fb = &laptop->fb;
+    const __u8 *back = razer_fb_back(fb);
+    const __u8 *front = razer_fb_front(fb);
+    int start[RAZER_MATRIX_ROWS], end[RAZER_MATRIX_ROWS];
+    int row, key;
+    int rows_sent = 0;
+
+    for (row = 0; row < RAZER_MATRIX_ROWS; row++) {
+        const __u8 *new_row = &back[row * 45];
+        const __u8 *old_row = &front[row * 45];
+
+        if (!fb->valid) {
+            start[row] = 0;
+            end[row] = 14;
+            continue;
+        }
+        // Find the smallest span of keys that changed
+        start[row] = -1;
+        end[row] = -1;
+        for (key = 0; key < 15; key++) {
+            if (memcmp(&old_row[key * 3], &new_row[key * 3], 3)) {
+                if (start[row] < 0) {
+                    start[row] = key;
+                }
+                end[row] = key;
+            }
+        }
+        // The previous packet of this row hasn't gone out yet and is
+        // about to be replaced, so it has to cover those keys as well
+        if (start[row] >= 0 && razer_async_row_pending(&laptop->async, row)) {
+            start[row] = min(start[row], fb->staged_start[row]);
+            end[row] = max(end[row], fb->staged_end[row]);
+        }
+    }
+
+    // The back frame becomes the front frame, rows are sent from there
+    fb->back ^= 1;
+    fb->valid = true;
+
+    for (row = 0; row < RAZER_MATRIX_ROWS; row++) {
+        if (start[row] < 0) {
+            continue; // Row unchanged
+        }
+        sendRowSpanToProfile(laptop, row, start[row], end[row]);
+        rows_sent++;
+    }
+
+    laptop->matrix_stats.frames++;
+    laptop->matrix_stats.rows_sent += rows_sent;
+    laptop->matrix_stats.rows_skipped += RAZER_MATRIX_ROWS - rows_sent;
+    laptop->matrix_stats.last_rows_sent = rows_sent;
+    laptop->matrix_stats.last_rows_skipped = RAZER_MATRIX_ROWS - rows_sent;
+
+    // Nothing changed, so the EC is already displaying this frame
+    if (rows_sent) {
+        displayProfile(laptop, 0);
+    }
+    return rows_sent;
+}
+
+int sendKeySpan(struct razer_laptop *laptop, int row_number, int start_key, int end_key, const __u8 *colours) {
+    struct razer_framebuffer *fb = &laptop->fb;
+
+    memcpy(razer_fb_front(fb) + row_number * 45 + start_key * 3, colours, (end_key - start_key + 1) * 3);
+    // Same as in flipMatrixFrame, don't lose the keys of a packet about to be replaced
+    if (razer_async_row_pending(&laptop->async, row_number)) {
+        start_key = min(start_key, fb->staged_start[row_number]);
+        end_key = max(end_key, fb->staged_end[row_number]);
+    }
+    sendRowSpanToProfile(laptop, row_number, start_key, end_key);
+    displayProfile(laptop, 0);
     return 0;
 }
 
-int displayProfile(struct usb_device *usb, int profileNum) {
+int sendMatrixFrame(struct razer_laptop *laptop, const char *frame) {
+    memcpy(razer_fb_back(&laptop->fb), frame, RAZER_FRAME_LEN);
+    return flipMatrixFrame(laptop);
+}
+
+static enum hrtimer_restart razer_frame_queue_due(struct hrtimer *timer)
+{
+    struct razer_frame_queue *queue = container_of(timer, struct razer_frame_queue, timer);
+
+    queue_work(system_highpri_wq, &queue->work);
+    return HRTIMER_NORESTART;
+}
+
+static void razer_frame_queue_present(struct work_struct *work)
+{
+    struct razer_laptop *laptop = container_of(work, struct razer_laptop, frame_queue.work);
+    struct razer_frame_queue *queue = &laptop->frame_queue;
+    bool due = false;
+    __u64 now;
+
+    mutex_lock(&laptop->lock);
+    spin_lock_irq(&queue->lock);
+    now = ktime_get_ns();
+    while (queue->count && queue->frames[queue->head].present_ns <= now) {
+        if (due) {
+            queue->dropped++; // A newer frame is due as well
+        }
+        memcpy(razer_fb_back(&laptop->fb), queue->frames[queue->head].keys, RAZER_FRAME_LEN);
+        queue->head = (queue->head + 1) % RAZER_FRAME_QUEUE_LEN;
+        queue->count--;
+        due = true;
+    }
+    if (queue->count) {
+        hrtimer_start(&queue->timer, ns_to_ktime(queue->frames[queue->head].present_ns), HRTIMER_MODE_ABS);
+    }
+    spin_unlock_irq(&queue->lock);
+
+    if (due) {
+        queue->presented++;
+        flipMatrixFrame(laptop);
+    }
+    mutex_unlock(&laptop->lock);
+}
+
+void razer_frame_queue_init(struct razer_frame_queue *queue) {
+    spin_lock_init(&queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    queue->stopped = false;
+    queue->presented = 0;
+    queue->dropped = 0;
+    hrtimer_init(&queue->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    queue->timer.function = razer_frame_queue_due;
+    INIT_WORK(&queue->work, razer_frame_queue_present);
+}
+
+void razer_frame_queue_destroy(struct razer_frame_queue *queue) {
+    unsigned long flags;
+
+    // Once the queue is empty, neither a push nor the work arms the timer
+    spin_lock_irqsave(&queue->lock, flags);
+    queue->stopped = true;
+    queue->count = 0;
+    spin_unlock_irqrestore(&queue->lock, flags);
+    // The timer first: it may still queue the work, the work never arms it again
+    hrtimer_cancel(&queue->timer);
+    cancel_work_sync(&queue->work);
+}
+
+int razer_frame_queue_push(struct razer_frame_queue *queue, const struct razer_timed_frame *frames, int count) {
+    struct razer_timed_frame *tail;
+    unsigned long flags;
+    bool was_empty;
+    int i;
+
+    spin_lock_irqsave(&queue->lock, flags);
+    if (queue->stopped) {
+        spin_unlock_irqrestore(&queue->lock, flags);
+        return 0;
+    }
+    was_empty = queue->count == 0;
+    for (i = 0; i < count && queue->count < RAZER_FRAME_QUEUE_LEN; i++) {
+        tail = &queue->frames[(queue->head + queue->count) % RAZER_FRAME_QUEUE_LEN];
+        *tail = frames[i];
+        // Frames are shown in the order they are queued
+        if (queue->count && tail->present_ns < queue->frames[(queue->head + queue->count - 1) % RAZER_FRAME_QUEUE_LEN].present_ns) {
+            tail->present_ns = queue->frames[(queue->head + queue->count - 1) % RAZER_FRAME_QUEUE_LEN].present_ns;
+        }
+        queue->count++;
+    }
+    if (was_empty && queue->count) {
+        hrtimer_start(&queue->timer, ns_to_ktime(queue->frames[queue->head].present_ns), HRTIMER_MODE_ABS);
+    }
+    spin_unlock_irqrestore(&queue->lock, flags);
+    return i;
+}
+
+void razer_frame_queue_flush(struct razer_frame_queue *queue) {
+    unsigned long flags;
+
+    // Under the lock, so a push right after this keeps the timer it arms
+    spin_lock_irqsave(&queue->lock, flags);
+    queue->count = 0;
+    hrtimer_try_to_cancel(&queue->timer);
+    spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+int razer_frame_queue_count(struct razer_frame_queue *queue) {
+    unsigned long flags;
+    int count;
+
+    spin_lock_irqsave(&queue->lock, flags);
+    count = queue->count;
+    spin_unlock_irqrestore(&queue->lock, flags);
+    return count;
+}
+
+int displayProfile(struct razer_laptop *laptop, int profileNum) {
     struct razer_packet packet = {0};
     packet = get_razer_report(0x03, 0x0a, 0x02);
 
-    packet.args[0] = 0x05;
+    packet.args[0] = RAZER_EFFECT_CUSTOM;
     packet.args[1] = 0x00;
-    send_payload(usb, &packet);
+    packet.crc = crc(&packet);
+    razer_async_queue_display(&laptop->async, &packet);
+    // Back to the custom frame
+    laptop->effect.valid = false;
+    return 0;
+}
+
+int sendMatrixEffect(struct razer_laptop *laptop, __u8 effect, const __u8 *args, int arg_count) {
+    struct razer_packet packet;
+
+    if (arg_count > RAZER_EFFECT_MAX_ARGS) {
+        return -EINVAL;
+    }
+    packet = get_razer_report(0x03, 0x0a, 1 + arg_count);
+    packet.args[0] = effect;
+    memcpy(&packet.args[1], args, arg_count);
+
+    // Rows that haven't gone out yet would be followed by a display packet,
+    // which switches the EC back to the custom frame
+    razer_async_cancel_frame(&laptop->async);
+    // The EC no longer shows the front frame, so the next one goes out in full
+    laptop->fb.valid = false;
+
+    packet = send_payload(laptop, &packet);
+    if (packet.status != RAZER_CMD_SUCCESSFUL) {
+        laptop->effect.valid = false;
+        return -EIO;
+    }
+    // Kept for resume
+    laptop->effect.valid = true;
+    laptop->effect.effect = effect;
+    memcpy(laptop->effect.args, args, arg_count);
+    laptop->effect.arg_count = arg_count;
     return 0;
 }
 
-int sendBrightness(struct usb_device *usb, __u8 brightness) {
+int sendBrightness(struct razer_laptop *laptop, __u8 brightness) {
     struct razer_packet packet = {0};
     // bug ?
 #if 0
@@ -60,11 +324,14 @@ int sendBrightness(struct usb_device *usb, __u8 brightness) {
     packet.args[1] = 0x05;
     packet.args[2] = brightness;
 #endif
-    send_payload(usb, &packet);
+    packet = send_payload(laptop, &packet);
+    if (packet.status == RAZER_CMD_SUCCESSFUL) {
+        updateBrightnessCache(laptop, brightness);
+    }
     return 0;
 }
 
-int getBrightness(struct usb_device *usb) {
+int getBrightness(struct razer_laptop *laptop) {
     struct razer_packet req = {0};
     struct razer_packet resp = {0};
 #if 0
@@ -86,10 +353,182 @@ int getBrightness(struct usb_device *usb) {
     req.args[1] = 0x05;
     req.args[2] = 0x00;
 #endif
-    resp = send_payload(usb, &req);
+    resp = send_payload(laptop, &req);
 #if 0
     return resp.args[1];
 #else
+    if (resp.status == RAZER_CMD_SUCCESSFUL) {
+        // Not what we set, so the brightness keys or the EC changed it
+        if (READ_ONCE(laptop->brightness.valid) && READ_ONCE(laptop->brightness.value) != resp.args[2]) {
+            led_classdev_notify_brightness_hw_changed(&laptop->kbd_backlight, resp.args[2]);
+        }
+        updateBrightnessCache(laptop, resp.args[2]);
+    }
     return resp.args[2];
 #endif
 }
+
+void updateBrightnessCache(struct razer_laptop *laptop, __u8 brightness) {
+    WRITE_ONCE(laptop->brightness.value, brightness);
+    WRITE_ONCE(laptop->brightness.updated, jiffies);
+    WRITE_ONCE(laptop->brightness.valid, true);
+}
+
+void invalidateBrightnessCache(struct razer_laptop *laptop) {
+    WRITE_ONCE(laptop->brightness.valid, false);
+}
+
+int getCachedBrightness(struct razer_laptop *laptop, unsigned int max_age_ms) {
+    struct razer_brightness_cache *cache = &laptop->brightness;
+
+    if (READ_ONCE(cache->valid) &&
+        (max_age_ms == 0 || time_before(jiffies, READ_ONCE(cache->updated) + msecs_to_jiffies(max_age_ms)))) {
+        return READ_ONCE(cache->value);
+    }
+    return getBrightness(laptop);
+}
+
+/*
+ * Works out the brightness at a point in the pattern, and how long (ms) until
+ * it changes next. Must be called with ramp->lock held
+ */
+static int razer_ramp_brightness(struct razer_ramp *ramp, u32 t, u32 *next_ms) {
+    const struct led_pattern *step, *next;
+    u32 i;
+
+    for (i = 0; i < ramp->count; i++) {
+        step = &ramp->steps[i];
+        if (t >= step->delta_t) {
+            t -= step->delta_t;
+            continue;
+        }
+        next = &ramp->steps[(i + 1) % ramp->count];
+        if (step->brightness == next->brightness) {
+            *next_ms = step->delta_t - t; // Holds until the end of the step
+            return step->brightness;
+        }
+        *next_ms = RAZER_RAMP_INTERVAL_MS;
+        return step->brightness + (int) div_s64((s64) (next->brightness - step->brightness) * t, step->delta_t);
+    }
+    *next_ms = RAZER_RAMP_INTERVAL_MS;
+    return ramp->steps[ramp->count - 1].brightness;
+}
+
+static void razer_ramp_work(struct work_struct *work) {
+    struct razer_ramp *ramp = container_of(to_delayed_work(work), struct razer_ramp, work);
+    struct razer_laptop *laptop = container_of(ramp, struct razer_laptop, ramp);
+    __u64 elapsed_ms;
+    __u64 cycles;
+    u32 t;
+    u32 next_ms;
+    int brightness;
+    bool done;
+    bool send;
+
+    spin_lock_irq(&ramp->lock);
+    if (!ramp->running) {
+        spin_unlock_irq(&ramp->lock);
+        return;
+    }
+    elapsed_ms = div_u64(ktime_get_ns() - ramp->start_ns, NSEC_PER_MSEC);
+    cycles = div_u64_rem(elapsed_ms, ramp->cycle_ms, &t);
+    done = ramp->repeat >= 0 && cycles >= ramp->repeat;
+    if (done) {
+        // Finished, stay on the last step
+        brightness = ramp->steps[ramp->count - 1].brightness;
+        ramp->running = false;
+    } else {
+        brightness = razer_ramp_brightness(ramp, t, &next_ms);
+    }
+    send = brightness != ramp->last;
+    ramp->last = brightness;
+    spin_unlock_irq(&ramp->lock);
+
+    if (send) {
+        sendBrightness(laptop, (__u8) clamp(brightness, 0, 255));
+    }
+    if (!done) {
+        schedule_delayed_work(&ramp->work, msecs_to_jiffies(max_t(u32, next_ms, RAZER_RAMP_INTERVAL_MS)));
+    }
+}
+
+void razer_ramp_init(struct razer_laptop *laptop) {
+    struct razer_ramp *ramp = &laptop->ramp;
+
+    spin_lock_init(&ramp->lock);
+    INIT_DELAYED_WORK(&ramp->work, razer_ramp_work);
+    ramp->count = 0;
+    ramp->running = false;
+    ramp->paused = false;
+}
+
+int razer_ramp_start(struct razer_laptop *laptop, const struct led_pattern *steps, u32 count, int repeat) {
+    struct razer_ramp *ramp = &laptop->ramp;
+    u32 cycle_ms = 0;
+    u32 i;
+
+    if (count == 0 || count > RAZER_RAMP_MAX_STEPS) {
+        return -EINVAL;
+    }
+    for (i = 0; i < count; i++) {
+        cycle_ms += steps[i].delta_t;
+    }
+    if (cycle_ms == 0) {
+        return -EINVAL;
+    }
+
+    razer_ramp_stop(laptop);
+    spin_lock_irq(&ramp->lock);
+    memcpy(ramp->steps, steps, count * sizeof(*steps));
+    ramp->count = count;
+    ramp->cycle_ms = cycle_ms;
+    ramp->repeat = repeat;
+    ramp->start_ns = ktime_get_ns();
+    ramp->last = -1;
+    ramp->running = true;
+    spin_unlock_irq(&ramp->lock);
+    schedule_delayed_work(&ramp->work, 0);
+    return 0;
+}
+
+void razer_ramp_stop(struct razer_laptop *laptop) {
+    struct razer_ramp *ramp = &laptop->ramp;
+
+    spin_lock_irq(&ramp->lock);
+    ramp->running = false;
+    ramp->paused = false;
+    spin_unlock_irq(&ramp->lock);
+    cancel_delayed_work_sync(&ramp->work);
+}
+
+void razer_ramp_pause(struct razer_laptop *laptop) {
+    struct razer_ramp *ramp = &laptop->ramp;
+
+    spin_lock_irq(&ramp->lock);
+    if (ramp->running) {
+        ramp->running = false;
+        ramp->paused = true;
+        ramp->paused_ns = ktime_get_ns();
+    }
+    spin_unlock_irq(&ramp->lock);
+    cancel_delayed_work_sync(&ramp->work);
+}
+
+void razer_ramp_resume(struct razer_laptop *laptop) {
+    struct razer_ramp *ramp = &laptop->ramp;
+    bool paused;
+
+    spin_lock_irq(&ramp->lock);
+    paused = ramp->paused;
+    if (paused) {
+        // The time asleep doesn't count towards the pattern
+        ramp->start_ns += ktime_get_ns() - ramp->paused_ns;
+        ramp->last = -1;
+        ramp->running = true;
+        ramp->paused = false;
+    }
+    spin_unlock_irq(&ramp->lock);
+    if (paused) {
+        schedule_delayed_work(&ramp->work, 0);
+    }
+}
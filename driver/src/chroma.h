@@ -8,54 +8,174 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/vmalloc.h>
 #include "fancontrol.h"
 #include "core.h"
+#include "async.h"
 
 
+// Matrix effects built into the EC (command 0x03/0x0a, effect id in args[0])
+#define RAZER_EFFECT_NONE      0x00
+#define RAZER_EFFECT_WAVE      0x01 // args: direction (1 or 2)
+#define RAZER_EFFECT_REACTIVE  0x02 // args: speed (1-4), r, g, b
+#define RAZER_EFFECT_BREATHING 0x03 // args: type (1 = one colour, 2 = two colours, 3 = random), colours
+#define RAZER_EFFECT_SPECTRUM  0x04
+#define RAZER_EFFECT_CUSTOM    0x05 // args: profile, displays the uploaded rows
+#define RAZER_EFFECT_STATIC    0x06 // args: r, g, b
+
+/**
+ * Allocates the frame buffer. Both frames start out black
+ */
+int razer_fb_init(struct razer_framebuffer *fb);
+
+void razer_fb_destroy(struct razer_framebuffer *fb);
+
+/**
+ * Returns the frame userspace is drawing into
+ */
+__u8 *razer_fb_back(struct razer_framebuffer *fb);
+
+/**
+ * Returns the frame that was last sent to the EC
+ */
+__u8 *razer_fb_front(struct razer_framebuffer *fb);
+
+void razer_frame_queue_init(struct razer_frame_queue *queue);
+
+/**
+ * Stops the timer and waits for a frame being presented
+ */
+void razer_frame_queue_destroy(struct razer_frame_queue *queue);
+
+/**
+ * Queues frames to be presented at their present_ns
+ * @return Number of frames queued, less than count if the queue is full
+ */
+int razer_frame_queue_push(struct razer_frame_queue *queue, const struct razer_timed_frame *frames, int count);
+
 /**
- * Holds data regarding an individual key's colour and saturation
+ * Drops every frame that hasn't been presented yet
  */
-struct key_colour { // I'm British. colour is spelt like this and not 'color' :)
-    __u8 red; // Red level (0-255)
-    __u8 green; // Green level (0-255)
-    __u8 blue; // Blue level (0-255)
-};
+void razer_frame_queue_flush(struct razer_frame_queue *queue);
 
 /**
- * Holds packet info to be sent to the device
+ * Returns the number of frames waiting to be presented
  */
-struct row_data {
-    int row_id;
-    int profileNumber;
-    struct key_colour keys[15]; // White default colour
-};
+int razer_frame_queue_count(struct razer_frame_queue *queue);
 
 /**
- * Takes a char array and turns it into a char[90] packet to be sent to the keyboard
+ * Takes a row of the front frame and turns it into a char[90] packet to be sent to the keyboard
+ * The packet is staged on the asynchronous packet engine, this does not wait
+ * for it to be sent
  * @param row_num Row Number (0 = F0-12 row, 5=CTRL+Fn+Win row)
- * @param profileNum Profile number to store row data in EEPROM
- * @param buffer;
- * @param usb USB device of keyboard
+ * @param laptop Laptop the keyboard belongs to
+ */
+int sendRowDataToProfile(struct razer_laptop *laptop, int row_number);
+
+/**
+ * Same as sendRowDataToProfile, but only sends the keys from start_key to
+ * end_key (inclusive, 0-14)
+ */
+int sendRowSpanToProfile(struct razer_laptop *laptop, int row_number, int start_key, int end_key);
+
+/**
+ * Presents the back frame: swaps the two frames and sends only the keys that
+ * differ from the previous front frame, followed by a display packet.
+ * Must be called with laptop->lock held
+ * @return Number of rows sent
+ */
+int flipMatrixFrame(struct razer_laptop *laptop);
+
+/**
+ * Changes the keys start_key to end_key (inclusive, 0-14) of a row in the
+ * front frame and sends only those, followed by a display packet. The back
+ * frame is left alone.
+ * Must be called with laptop->lock held
+ * @param colours 3 bytes (red, green, blue) per key
+ */
+int sendKeySpan(struct razer_laptop *laptop, int row_number, int start_key, int end_key, const __u8 *colours);
+
+/**
+ * Copies a RAZER_FRAME_LEN byte frame into the back frame and presents it.
+ * Must be called with laptop->lock held
+ * @return Number of rows sent
  */
-int sendRowDataToProfile(struct usb_device *usb, int row_number);
+int sendMatrixFrame(struct razer_laptop *laptop, const char *frame);
 
 /**
- * Tells the keyboard to display whatever data is stored for a given profile number
- * @param usb USB Device of keyboard
+ * Tells the keyboard to display whatever data is stored for a given profile number.
+ * Sent by the asynchronous packet engine once every staged row has gone out
+ * @param laptop Laptop the keyboard belongs to
  * @param profileNum profile number to display
  */
-int displayProfile(struct usb_device *usb, int profileNum);
+int displayProfile(struct razer_laptop *laptop, int profileNum);
+
+/**
+ * Switches the keyboard to one of the EC's own effects, which it then runs
+ * without any help from us. Any frame still being uploaded is dropped, and
+ * the next frame is sent in full.
+ * Must be called with laptop->lock held
+ * @param effect RAZER_EFFECT_*
+ * @param args Parameters of the effect, up to RAZER_EFFECT_MAX_ARGS
+ * @return 0, -EINVAL or -EIO if the EC refused it
+ */
+int sendMatrixEffect(struct razer_laptop *laptop, __u8 effect, const __u8 *args, int arg_count);
+
+/**
+ * Sends every row of the front frame again
+ */
+int displayMatrix(struct razer_laptop *laptop);
+
+/**
+ * Sets the keyboard backlight brightness, and caches it if the EC accepted it
+ */
+int sendBrightness(struct razer_laptop *laptop, __u8 brightness);
+
+/**
+ * Reads the keyboard backlight brightness from the EC, and caches it
+ */
+int getBrightness(struct razer_laptop *laptop);
 
 /**
- * Sets the keyboard to the content of [matrix]
+ * Returns the cached brightness, only asking the EC if nothing is cached or the
+ * cached value is older than max_age_ms (0 = never too old)
  */
-int displayMatrix(struct usb_device *usb);
+int getCachedBrightness(struct razer_laptop *laptop, unsigned int max_age_ms);
 
-int sendBrightness(struct usb_device *usb, __u8 brightness);
+void razer_ramp_init(struct razer_laptop *laptop);
 
-int getBrightness(struct usb_device *usb);
+/**
+ * Starts running a backlight pattern, replacing the one that was running
+ * @param steps LED pattern, brightness fades from each step to the next
+ * @param repeat Runs through the pattern, -1 for forever
+ * @return 0, or -EINVAL if the pattern is too long or takes no time
+ */
+int razer_ramp_start(struct razer_laptop *laptop, const struct led_pattern *steps, u32 count, int repeat);
+
+/**
+ * Stops the running pattern and waits for the worker. The brightness stays
+ * where the pattern left it
+ */
+void razer_ramp_stop(struct razer_laptop *laptop);
+
+/**
+ * Stops the running pattern for suspend, and waits for the worker
+ */
+void razer_ramp_pause(struct razer_laptop *laptop);
+
+/**
+ * Picks up a pattern paused by razer_ramp_pause where it left off, and sends
+ * its brightness again
+ */
+void razer_ramp_resume(struct razer_laptop *laptop);
 
-extern struct row_data matrix[5];
+void updateBrightnessCache(struct razer_laptop *laptop, __u8 brightness);
+
+/**
+ * Forces the next getCachedBrightness to ask the EC. Used whenever the EC
+ * might have changed the brightness behind our back (resume, hotkeys)
+ */
+void invalidateBrightnessCache(struct razer_laptop *laptop);
 
 #endif
 
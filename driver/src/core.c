@@ -1,5 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "core.h"
+#include "async.h"
+#include "stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "razer_trace.h"
 
 
 /**
@@ -75,116 +80,87 @@ char *getDeviceDescription(int product_id)
 	}
 }
 
-/**
- * Sends payload to the EC controller
- *
- * @param usb_device EC Controller USB device struct
- * @param buffer Payload buffer
- * @param minWait Minimum time to wait in us after sending the payload
- * @param maxWait Maximum time to wait in us after sending the payload
- */
-int send_control_message(struct usb_device *usb_dev, void const *buffer, unsigned long minWait, unsigned long maxWait)
+void razer_pacing_init(struct razer_pacing *pacing)
 {
-    uint request = HID_REQ_SET_REPORT; // 0x09
-    uint request_type = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT; // 0x21
-    uint value = 0x300;
-    uint report_index = 0x02;
-    uint size = RAZER_USB_REPORT_LEN;
-	char *buf;
-	int len;
-
-	/* crc(buffer); // Generate checksum for payload */
-	buf = kmemdup(buffer, size, GFP_KERNEL);
-
-    if(buf == NULL)
-    {
-        return -ENOMEM;
-    }
-
-	len = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0),
-			      request,
-			      request_type,
-			      value,
-			      report_index,
-			      buf,
-			      size,
-			      USB_CTRL_SET_TIMEOUT);
-	// Sleep for a specified number of us. If we send packets too quickly,
-	// the EC will ignore them
-	usleep_range(minWait, maxWait);
-
-	kfree(buf);
-    if(len != size)
-    {
-        printk(KERN_WARNING "Razer laptop control: Device data transfer failed.");
-    }
-
-	return ((len < 0) ? len : ((len != size) ? -EIO : 0));
+    spin_lock_init(&pacing->lock);
+    pacing->spacing_us = RAZER_PACKET_SPACING_US;
+    pacing->clean_streak = 0;
+    pacing->busy_retries = 0;
+    pacing->busy_failures = 0;
+    pacing->mismatches = 0;
+    pacing->resends = 0;
 }
 
 /**
- * Sends packet in req_buffer and puts device response
- * int resp_buffer.
+ * Learns the spacing the EC needs. After a run of clean exchanges the spacing
+ * is lowered a little, as soon as the EC reports busy or answers with the
+ * wrong response it is doubled.
  *
- * TODO - Work out device calls for all querys (Fan RPM, Matrix brightness and Power mode).
- * Should be possible tracing packets when Synapse first loads up.
+ * Must be called with pacing->lock held
  */
-int get_usb_responce(struct usb_device *usb_dev, struct razer_packet* req_buffer, struct razer_packet* resp_buffer, unsigned long minWait, unsigned long maxWait)
+static void razer_pacing_update(struct razer_pacing *pacing, bool clean)
 {
-	uint request = HID_REQ_GET_REPORT; // 0x01
-	uint request_type = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_IN; // 0xA1
-    uint value = 0x300;
-    uint response_index = 0x02;
-    uint size = RAZER_USB_REPORT_LEN;
-	uint len;
-    int result = 0;
-	char *buf;
-
-	buf = kzalloc(sizeof(char[90]), GFP_KERNEL);
-	if (buf == NULL) {
-		return -ENOMEM;
-	}
+    unsigned int spacing = READ_ONCE(pacing->spacing_us);
 
-    // Send request to device
-	send_control_message(usb_dev, req_buffer, minWait, maxWait);
-	len = usb_control_msg(usb_dev, usb_rcvctrlpipe(usb_dev, 0),
-			request,
-			request_type,
-			value,
-			response_index,
-			buf,
-			size,
-			USB_CTRL_SET_TIMEOUT);
-
-	memcpy(resp_buffer, buf, RAZER_USB_REPORT_LEN);
-	kfree(buf);
-
-	if (len != 90) {
-		dev_warn(&usb_dev->dev, "Razer laptop control: USB Response invalid. Got %d bytes. Expected 90.", len);
-        result = 1;
-	}
-
-	return result;
+    if (clean) {
+        if (++pacing->clean_streak < RAZER_SPACING_STREAK) {
+            return;
+        }
+        spacing = max(spacing - RAZER_SPACING_STEP_US, (unsigned int) RAZER_SPACING_MIN_US);
+    } else {
+        spacing = min(spacing * 2, (unsigned int) RAZER_SPACING_MAX_US);
+    }
+    pacing->clean_streak = 0;
+    WRITE_ONCE(pacing->spacing_us, spacing);
 }
 
-struct razer_packet send_payload(struct usb_device *usb_dev, struct razer_packet *request_report)
+struct razer_packet send_payload(struct razer_laptop *laptop, struct razer_packet *request_report)
 {
     int retval = -1;
-    struct razer_packet response_report = {0};
+    struct razer_command command;
+    struct razer_packet response_report;
+    struct razer_pacing *pacing = &laptop->pacing;
+    unsigned long flags;
+    bool mismatch = false;
+    int retries;
 
     request_report->crc = crc(request_report);
 
-    retval = get_usb_responce(usb_dev, request_report, &response_report, 600, 800); //min max as parameters ? in openrazer ther are not
+    // Queued by priority behind at most the packet in flight. The engine
+    // asks a busy EC again, and spaces the packets as learned
+    command.request = *request_report;
+    retval = razer_async_exchange(&laptop->async, &command);
+    response_report = command.response;
+    retries = command.retries;
+    trace_razer_ec_payload(&command.request, response_report.status, retries + command.resends, retval, command.usb_ns, command.sleep_ns);
+
+    if(retval == 0) {
+        // Check the transaction, packet number, class and command are the same
+        mismatch = !razer_async_response_matches(&laptop->async, &command.request, &response_report) ||
+                   response_report.remaining_packets != request_report->remaining_packets;
+    }
+    spin_lock_irqsave(&pacing->lock, flags);
+    pacing->busy_retries += retries;
+    pacing->resends += command.resends;
+    if (retval == 0 && mismatch) {
+        pacing->mismatches++;
+    } else if (retval == 0 && response_report.status == RAZER_CMD_BUSY) {
+        pacing->busy_failures++;
+    }
+    razer_pacing_update(pacing, retval == 0 && retries == 0 && command.resends == 0 && !mismatch);
+    spin_unlock_irqrestore(&pacing->lock, flags);
+    razer_stats_record(&laptop->stats, request_report, response_report.status, retval, mismatch,
+                       command.usb_ns + command.sleep_ns, RAZER_USB_REPORT_LEN * 2 * (1 + command.resends) + RAZER_USB_REPORT_LEN * retries);
 
     if(retval == 0) {
-        // Check the packet number, class and command are the same
-        if(response_report.remaining_packets != request_report->remaining_packets ||
-           response_report.command_class != request_report->command_class ||
-           response_report.command_id.id != request_report->command_id.id) {
-           // This can occur if we wire too many commands at once. Ignore
-	   //print_erroneous_report(&response_report, "Razer laptop control", "Response doesn't match request");
-//		} else if (response_report.status == RAZER_CMD_BUSY) {
-//			print_erroneous_report(&response_report, "razerkbd", "Device is busy");
+        if(mismatch) {
+           // The response got lost every time we sent it. The spacing has
+           // been raised, so it shouldn't happen again
+           print_erroneous_report(&response_report, "Razer laptop control", "Response doesn't match request");
+           // It answers some other packet, don't let the caller read it
+           response_report.status = RAZER_CMD_FAILURE;
+        } else if (response_report.status == RAZER_CMD_BUSY) {
+            print_erroneous_report(&response_report, "Razer laptop control", "Device is busy");
         } else if (response_report.status == RAZER_CMD_FAILURE) {
             print_erroneous_report(&response_report, "Razer laptop control", "Command failed");
         } else if (response_report.status == RAZER_CMD_NOT_SUPPORTED) {
@@ -8,6 +8,15 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/usb.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/leds.h>
+#include <linux/debugfs.h>
 #include "fancontrol.h"
 #include "defines.h"
 
@@ -18,37 +27,6 @@
 #define RAZER_CMD_TIMEOUT       0x04
 #define RAZER_CMD_NOT_SUPPORTED 0x05
 
-// Struct to hold some basic data about the laptops current state
-// Driver data representation
-typedef struct {
-    __u8 r; // Red channel
-    __u8 g; // Green channel
-    __u8 b; // Blue channel
-} key;
-
-typedef struct {
-    __u8 rowid; // Row ID (0-5) used by the EC to update each row
-    key keys[15]; // 15 keys per row (regardless if the LEDs are present or not)
-} keyboard_row;
-
-// Keyboard structs
-typedef struct {
-    __u8 brightness; // 0-255 brightness
-    keyboard_row rows[6]; // 6 rows
-} keyboard_info;
-
-// Power/fan control struct
-typedef struct razer_laptop {
-    int product_id; // Product ID - Used for working out device capabilities
-    struct mutex lock; // Lock mutex
-    struct usb_device *usb_dev;	// USB Device for communication
-    __u16 fan_rpm; // Fan RPM Set by driver (0 if it is auto!)
-    __u8 power_mode; // Power mode (0 = normal, 1 = gaming, 2 = creator, 4 = custom)
-    __u8 cpu_boost; // only for custom mode
-    __u8 gpu_boost; // only for custom mode
-    keyboard_info kbd; // Keyboard data
-} razer_laptop;
-
 union transaction_id_union {
     unsigned char id;
     struct transaction_parts {
@@ -95,16 +73,436 @@ struct razer_packet {
     __u8 reserved; // 0x00
 };
 
+// Number of rows in the keyboard matrix
+#define RAZER_MATRIX_ROWS 6
+
+// Time in us the EC is given between two packets until we learn better
+#define RAZER_PACKET_SPACING_US 600
+
+// Bounds and step of the learned packet spacing
+#define RAZER_SPACING_MIN_US 100
+#define RAZER_SPACING_MAX_US 2000
+#define RAZER_SPACING_STEP_US 25
+
+// Clean exchanges in a row before the spacing is lowered
+#define RAZER_SPACING_STREAK 32
+
+// How often a busy EC is asked again for its response, and the first delay (doubles)
+#define RAZER_BUSY_RETRIES 5
+#define RAZER_BUSY_BACKOFF_US 100
+
+// How often a command is sent again when the response we got belongs to something else
+#define RAZER_LOST_RETRIES 2
+
+/**
+ * Packet spacing learned from the EC
+ *
+ * Each model of EC needs a different amount of time before it will take the
+ * next packet or has the response ready. We start safe and work our way down
+ * while the EC keeps up.
+ */
+struct razer_pacing {
+    spinlock_t lock; // Protects everything below, commands finish concurrently
+    unsigned int spacing_us; // Current spacing in us, read locklessly by the engine
+    unsigned int clean_streak; // Exchanges without busy / mismatch in a row
+    __u64 busy_retries; // Times a busy EC was asked again
+    __u64 busy_failures; // Times the EC was still busy after all retries
+    __u64 mismatches; // Responses that didn't belong to the request
+    __u64 resends; // Commands sent again because their response was lost
+};
+
+// Priority classes of the packet engine, lower goes first
+enum razer_priority {
+    RAZER_PRIO_THERMAL, // Fan and power commands (class 0x0d)
+    RAZER_PRIO_CONTROL, // Brightness and any other command waiting for a response
+    RAZER_PRIO_FRAME, // Matrix rows and the display packet
+    RAZER_PRIO_COUNT
+};
+
+// Commands that can wait in each command class before producers have to wait
+#define RAZER_COMMAND_QUEUE_DEPTH 8
+
+// Where a command is in its exchange with the EC
+enum razer_command_state {
+    RAZER_COMMAND_SENDING, // SET_REPORT in flight / waiting out the spacing
+    RAZER_COMMAND_RECEIVING, // GET_REPORT in flight
+    RAZER_COMMAND_BACKOFF, // EC was busy, waiting to ask again
+};
+
+/**
+ * A command waiting for the EC's response, queued on the packet engine by
+ * send_payload. Owned by the caller until done completes
+ */
+struct razer_command {
+    struct list_head node; // Entry in the queue of its priority class
+    struct razer_packet request;
+    struct razer_packet response;
+    enum razer_command_state state;
+    int result; // 0, or why the exchange failed
+    int retries; // Times a busy EC was asked again
+    int resends; // Times the command was sent again because its response was lost
+    __u64 usb_ns; // Time spent in USB transfers
+    __u64 sleep_ns; // Time spent waiting for the EC
+    struct completion done; // Completed once the response is in
+};
+
+// How long a single transfer may take, same as usb_control_msg
+#define RAZER_TRANSFER_TIMEOUT_MS USB_CTRL_SET_TIMEOUT
+
+struct razer_async;
+
+/**
+ * How packets get to the EC. The packet engine only ever talks to the EC
+ * through one of these, so it can run on something other than the USB device
+ */
+struct razer_transport_ops {
+    const char *name;
+    int (*init)(struct razer_async *async); // Sets up transport_data
+    void (*destroy)(struct razer_async *async); // Frees transport_data, nothing is in flight anymore
+    // Starts sending async->buf (SET_REPORT), or reading the response into it
+    // (GET_REPORT). Called with async->lock held, must not sleep. The transfer
+    // ends with a call to razer_async_transfer_done
+    int (*submit)(struct razer_async *async, bool get);
+    void (*kill)(struct razer_async *async); // Cancels the transfer in flight and waits for it
+    // Cancels the transfer in flight without waiting. Called with async->lock
+    // held, so the transfer must end later, not from within unlink
+    void (*unlink)(struct razer_async *async);
+};
+
+/**
+ * Asynchronous packet engine
+ *
+ * Every packet goes to the EC through here, one at a time, over the transport.
+ * Once a packet has gone out, the spacing timer holds the next one back for
+ * the time the EC needs before it will accept another packet. Nothing in here
+ * ever sleeps, so it can be fed from sysfs without blocking the writer.
+ *
+ * Whenever the line is free the most important packet goes next: queued
+ * thermal commands, then other commands, then matrix rows. A fan change
+ * never waits for more than the packet that is already in flight.
+ *
+ * Matrix rows are staged per row, so a new frame simply replaces the rows of a
+ * frame that has not gone out yet (latest wins).
+ */
+struct razer_async {
+    spinlock_t lock; // Protects everything below
+    const struct razer_transport_ops *transport; // How packets get to the EC
+    void *transport_data; // State of the transport (URB, simulated EC)
+    struct usb_device *usb_dev; // Device the packets are meant for
+    __u8 *buf; // DMA-able transfer buffer
+    struct hrtimer spacing_timer; // Enforces the spacing between packets
+    struct hrtimer watchdog_timer; // Unlinks a transfer the EC never finishes
+    bool in_flight; // A transfer has been handed to the transport
+    bool timed_out; // The transfer in flight was unlinked by the watchdog
+    const struct razer_pacing *pacing; // Spacing learned from the EC responses (send_payload)
+    struct razer_stats *stats; // Where sent packets are counted
+    ktime_t submitted; // When the packet in flight was submitted
+    __u64 transfers; // Transfers submitted, all of them out of buf
+    __u64 allocations; // Allocations made for transfers (buf, transport). Only ever at init
+    ktime_t timer_started; // When the spacing timer was started
+    wait_queue_head_t idle_wait; // Woken up when the engine goes idle or a queue has room
+    bool busy; // A packet is in flight, or we are waiting out the spacing
+    int halted; // Nothing new is submitted while non zero (unload)
+    struct razer_command *current_command; // Command being exchanged, NULL for rows
+    __u8 next_transaction; // Transaction id (5 bit) the next command is stamped with
+    bool echo_transaction; // The EC echoes our transaction ids, see razer_async_check_echo
+    struct list_head commands[RAZER_PRIO_FRAME]; // Queued commands of each command class
+    int queued[RAZER_PRIO_FRAME]; // Length of each command queue
+    unsigned long pending_rows; // Bitmap of staged rows still to be sent
+    bool pending_display; // Display the custom frame once all rows are sent
+    struct razer_packet rows[RAZER_MATRIX_ROWS]; // Staged row packets
+    struct razer_packet display; // Staged 'display custom frame' packet
+};
+
+// Power / fan state requested by the user
+struct razer_power_state {
+    __u16 fan_rpm; // Fan RPM Set by driver (0 if it is auto!)
+    __u8 power_mode; // Power mode (0 = normal, 1 = gaming, 2 = creator, 4 = custom)
+    __u8 cpu_boost; // only for custom mode
+    __u8 gpu_boost; // only for custom mode
+};
+
+// Fan zones of the EC. Zone 1 is the CPU side, zone 2 the GPU side
+#define RAZER_FAN_ZONES 2
+
+// Bits of razer_zone_state.known
+#define RAZER_EC_KNOWN_MODE  0x01 // power_mode and fan_manual
+#define RAZER_EC_KNOWN_RPM   0x02 // fan_rpm
+#define RAZER_EC_KNOWN_BOOST 0x04 // boost
+
+// What the EC confirmed for one fan zone
+struct razer_zone_state {
+    __u8 power_mode; // Power mode of the zone
+    __u8 fan_manual; // 1 if the zone runs at fan_rpm, 0 for auto
+    __u8 fan_rpm; // Fan RPM / 100
+    __u8 boost; // CPU boost (zone 1) or GPU boost (zone 2)
+    __u8 known; // RAZER_EC_KNOWN_* bits of the fields above that can be trusted
+};
+
+struct razer_ec_state {
+    struct razer_zone_state zone[RAZER_FAN_ZONES];
+};
+
+
+// Most packets a power state change can take (3 per zone)
+#define RAZER_POWER_PLAN_MAX (3 * RAZER_FAN_ZONES)
+
+// Packets needed to get the EC from its confirmed state to a requested one
+struct razer_power_plan {
+    int count;
+    struct razer_packet packets[RAZER_POWER_PLAN_MAX];
+};
+
+// Size of one frame: 6 rows of 15 keys, 3 bytes (RGB) per key
+#define RAZER_FRAME_LEN 270
+
+// Size of the frame buffer: one page per frame, two frames
+#define RAZER_FB_SIZE (2 * PAGE_SIZE)
+
+// Most parameter bytes an effect takes (two colour breathing)
+#define RAZER_EFFECT_MAX_ARGS 7
+
+/**
+ * Built in matrix effect the EC was last told to run, so it can be started
+ * again after a resume. Protected by laptop->lock
+ */
+struct razer_matrix_effect {
+    bool valid; // The EC runs this effect, not the custom frame
+    __u8 effect;
+    __u8 args[RAZER_EFFECT_MAX_ARGS];
+    int arg_count;
+};
+
+/**
+ * Double buffered keyboard frame buffer
+ *
+ * Each frame lives at the start of its own page, laid out like key_colour_map
+ * (row 0, key 0 to row 5, key 14). Userspace maps the whole thing through
+ * key_colour_fb, draws into the back frame and writes key_colour_flip to
+ * present it. The front frame is what the EC has been sent.
+ */
+struct razer_framebuffer {
+    __u8 *mem; // RAZER_FB_SIZE bytes, mappable by userspace
+    int back; // Index (0 or 1) of the frame userspace draws into
+    bool valid; // The front frame has been sent to the EC
+    int staged_start[RAZER_MATRIX_ROWS]; // Key span of the last staged packet of each row
+    int staged_end[RAZER_MATRIX_ROWS];
+};
+
+// Number of frames userspace can queue ahead
+#define RAZER_FRAME_QUEUE_LEN 16
+
+/**
+ * A frame written to key_colour_queue, presented once CLOCK_MONOTONIC
+ * reaches present_ns
+ */
+struct razer_timed_frame {
+    __u64 present_ns; // CLOCK_MONOTONIC time in ns
+    __u8 keys[RAZER_FRAME_LEN]; // Same layout as key_colour_map
+} __packed;
+
+/**
+ * Frames queued ahead by userspace
+ *
+ * The timer fires when the oldest frame is due, the work then copies it into
+ * the back frame and flips. If several frames are due at once, only the
+ * newest one is shown and the others are counted as dropped.
+ */
+struct razer_frame_queue {
+    spinlock_t lock; // Protects the ring
+    struct razer_timed_frame frames[RAZER_FRAME_QUEUE_LEN]; // Ring of queued frames
+    unsigned int head; // Oldest frame in the ring
+    unsigned int count; // Frames in the ring
+    bool stopped; // Being destroyed, nothing can be queued anymore
+    struct hrtimer timer; // Fires when the oldest frame is due
+    struct work_struct work; // Presents due frames
+    __u64 presented; // Frames shown
+    __u64 dropped; // Frames that were late and skipped
+};
+
+// Keyboard backlight brightness, as last set or read back from the EC
+struct razer_brightness_cache {
+    __u8 value; // 0-255 brightness
+    bool valid; // value can be trusted
+    unsigned long updated; // jiffies when value was set or read back
+};
+
+// Most steps a backlight pattern can have
+#define RAZER_RAMP_MAX_STEPS 16
+
+// How often a fading backlight is updated, about as often as the EC keeps up with
+#define RAZER_RAMP_INTERVAL_MS 20
+
+/**
+ * Runs LED blink and pattern requests for the keyboard backlight
+ *
+ * Brightness fades linearly from each step to the next over the delta_t of
+ * the step. The worker works out where in the pattern we are from the time
+ * it started, and only sends a brightness when it differs from the last one
+ * sent. It wakes at most every RAZER_RAMP_INTERVAL_MS while fading, and sleeps
+ * through steps that hold a brightness. Falling behind skips steps rather
+ * than queueing them.
+ */
+struct razer_ramp {
+    spinlock_t lock; // Protects everything below
+    struct delayed_work work;
+    struct led_pattern steps[RAZER_RAMP_MAX_STEPS];
+    u32 count; // Number of steps
+    u32 cycle_ms; // Length of one run through the pattern
+    int repeat; // Runs through the pattern, -1 for forever
+    __u64 start_ns; // When the pattern was started
+    int last; // Brightness last sent, -1 if none yet
+    bool running;
+    bool paused; // Stopped for suspend, picks up again on resume
+    __u64 paused_ns; // When it was paused
+};
+
+// Counters for the matrix upload path
+struct razer_matrix_stats {
+    __u64 frames; // Frames written by userspace
+    __u64 rows_sent; // Rows that had to be sent to the EC
+    __u64 rows_skipped; // Rows that were identical to what the EC already has
+    __u32 last_rows_sent; // Rows sent for the last frame
+    __u32 last_rows_skipped; // Rows skipped for the last frame
+};
+
+// Commands with their own statistics, the rest is counted in other
+#define RAZER_STATS_COMMANDS 32
+
+// Response statuses we count (RAZER_CMD_*)
+#define RAZER_STATS_STATUSES 6
+
+// Latency histogram buckets, bucket n counts transfers of 2^(n-1) to 2^n us
+#define RAZER_STATS_LATENCY_BUCKETS 16
+
+// Counters for one command (class and id)
+struct razer_cmd_stats {
+    __u8 command_class;
+    __u8 command_id;
+    __u64 sent; // Packets sent
+    __u64 bytes; // Bytes transferred both ways
+    __u64 status[RAZER_STATS_STATUSES]; // Responses by RAZER_CMD_* status
+    __u64 mismatches; // Responses that didn't belong to the request
+    __u64 io_errors; // Transfers that failed on the USB side
+    __u64 latency[RAZER_STATS_LATENCY_BUCKETS]; // log2 histogram in us
+};
+
+/**
+ * Statistics of all EC transfers, exposed in debugfs
+ */
+struct razer_stats {
+    spinlock_t lock; // Protects everything below, updated from URB completion too
+    int count; // Commands in use
+    struct razer_cmd_stats cmds[RAZER_STATS_COMMANDS];
+    __u64 other; // Packets of commands that didn't fit into cmds
+};
+
+/**
+ * Power/fan control struct
+ *
+ * One per supported HID device, set as its driver data. Everything the driver
+ * knows about a laptop lives in here, so devices never share any state.
+ */
+typedef struct razer_laptop {
+    int product_id; // Product ID - Used for working out device capabilities
+    struct mutex lock; // Lock mutex (frame buffer and matrix uploads)
+    struct mutex power_lock; // Protects power and the power_* fields, never held while talking to the EC
+    struct usb_device *usb_dev;	// USB Device for communication
+    struct device *dev; // HID device the sysfs entries live on
+    struct led_classdev kbd_backlight; // Keyboard backlight LED
+    char kbd_backlight_name[64]; // razerlaptop-<hid device>::kbd_backlight, one per keyboard
+    struct dentry *debugfs_dir; // Debug counters of this device
+    struct razer_power_state power; // Power state requested by the user
+    struct razer_ec_state ec; // Power state the EC confirmed, only touched by power_work
+    struct work_struct power_work; // Sends the newest requested power state to the EC
+    struct work_struct init_work; // Reads the EC's state once after probe
+    struct completion ec_read; // Completed once init_work is done, power_work waits for it
+    wait_queue_head_t power_wait; // Woken up whenever power_work is done
+    __u64 power_requested; // Bumped on every change of power
+    __u64 power_applied; // power_requested as of the last run of power_work
+    int power_result; // Result of the last run of power_work
+    struct razer_power_state power_notified; // Power state sysfs readers were last told about
+    bool fan_full_speed; // pwm*_enable was last set to 0
+    struct device *hwmon; // hwmon device exposing the fans
+    struct razer_framebuffer fb; // Keyboard frame buffer
+    struct razer_matrix_effect effect; // Built in effect last started
+    struct razer_frame_queue frame_queue; // Frames waiting to be presented
+    struct razer_brightness_cache brightness; // Keyboard backlight brightness
+    struct razer_ramp ramp; // Keyboard backlight blink / pattern
+    bool auto_suspended; // Last suspend was an autosuspend, the EC kept its state
+    const struct razer_transport_ops *transport; // USB, or the simulated EC
+    struct razer_pacing pacing; // Learned packet spacing
+    struct razer_async async; // Asynchronous packet engine (matrix uploads)
+    struct razer_matrix_stats matrix_stats; // Matrix upload counters
+    struct razer_stats stats; // Per command EC statistics
+} razer_laptop;
+
 char *getDeviceDescription(int product_id);
 __u8 crc(struct razer_packet *buffer);
-int send_control_message(struct usb_device *usb_dev, void const *buffer, unsigned long minWait, unsigned long maxWait);
-int get_usb_responce(struct usb_device *usb_dev, struct razer_packet* req_buffer, struct razer_packet* resp_buffer, unsigned long minWait, unsigned long maxWait);
+void razer_pacing_init(struct razer_pacing *pacing);
 void print_erroneous_report(struct razer_packet* report, char* driver_name, char* message);
 struct razer_packet get_razer_report(unsigned char command_class, unsigned char command_id, unsigned char data_size);
-struct razer_packet send_payload(struct usb_device *usb_dev, struct razer_packet *request_report);
+struct razer_packet send_payload(struct razer_laptop *laptop, struct razer_packet *request_report);
+
+/**
+ * Works out the packets needed to get the EC from the state it confirmed to
+ * the given one. Nothing that the EC already has is sent again
+ */
+void razer_plan_power(struct razer_laptop *laptop, const struct razer_power_state *power, struct razer_power_plan *plan);
+
+/**
+ * Sends the packets needed for the given power state, and records what the EC
+ * confirmed in laptop->ec. Only called from power_work
+ */
+int razer_apply_power_state(struct razer_laptop *laptop, const struct razer_power_state *power);
+
+void razer_power_init(struct razer_laptop *laptop);
 
+/**
+ * Asks the EC for the power mode, fan RPM and boosts of both zones, records
+ * them in laptop->ec and publishes them in laptop->power, unless a power change
+ * has been requested already. Called once from init_work, power_work waits for
+ * it
+ * @return 0, or -EIO if the EC didn't tell us its power mode
+ */
+int razer_read_power_state(struct razer_laptop *laptop);
+
+/**
+ * Forgets what the EC confirmed and sends the whole requested power state
+ * again, waiting for it. Used on resume, with power_work idle
+ * @return 0, or -EIO if the EC refused part of it
+ */
+int razer_power_replay(struct razer_laptop *laptop);
+
+/**
+ * Waits until every power state change requested so far has reached the EC
+ * @return 0, -EIO if the EC refused part of it, or -ERESTARTSYS
+ */
+int razer_power_sync(struct razer_laptop *laptop);
+
+/*
+ * The setters only record the requested state and schedule power_work, they
+ * return without waiting for the EC
+ */
 void set_fan_rpm(unsigned long x, struct razer_laptop *laptop);
 int set_power_mode(unsigned long x, struct razer_laptop *laptop);
 int set_custom_power_mode(unsigned long cpu_boost, unsigned long gpu_boost, struct razer_laptop *laptop);
+// Same as set_custom_power_mode, but leave the other boost alone
+void set_cpu_boost(unsigned long cpu_boost, struct razer_laptop *laptop);
+void set_gpu_boost(unsigned long gpu_boost, struct razer_laptop *laptop);
+
+/**
+ * Replaces the whole power state at once. Nothing is changed unless all of it
+ * is supported by the laptop
+ * @return 0, or -EINVAL
+ */
+int set_power_profile(const struct razer_power_state *profile, struct razer_laptop *laptop);
+
+/**
+ * Registers the hwmon device with the measured fan speeds and manual fan
+ * control. Needs the packet engine
+ */
+int razer_hwmon_register(struct razer_laptop *laptop);
+void razer_hwmon_unregister(struct razer_laptop *laptop);
 
 #endif
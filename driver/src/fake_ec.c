@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include "async.h"
+
+/*
+ * Simulated EC, selected with the fake_ec module parameter. Packets never
+ * reach the laptop, instead they are answered here the way the real EC
+ * would: every transfer takes a while, packets that come too quickly after
+ * the previous one are ignored, and the EC answers busy until it has had the
+ * time to act on a packet. That is enough to watch the packet engine, the
+ * pacing and the frame pipeline work without risking the fans.
+ */
+
+static unsigned int fake_ec_latency_us = 125;
+module_param(fake_ec_latency_us, uint, 0644);
+MODULE_PARM_DESC(fake_ec_latency_us, "Simulated EC: How long (us) every transfer takes");
+
+static unsigned int fake_ec_spacing_us = 400;
+module_param(fake_ec_spacing_us, uint, 0644);
+MODULE_PARM_DESC(fake_ec_spacing_us, "Simulated EC: Packets sent sooner than this (us) after the previous one are ignored");
+
+static unsigned int fake_ec_busy_us = 300;
+module_param(fake_ec_busy_us, uint, 0644);
+MODULE_PARM_DESC(fake_ec_busy_us, "Simulated EC: How long (us) after a packet it answers busy");
+
+static unsigned int fake_ec_timeout_every;
+module_param(fake_ec_timeout_every, uint, 0644);
+MODULE_PARM_DESC(fake_ec_timeout_every, "Simulated EC: Time out every n-th packet. 0 = never");
+
+// Most colours a row packet can carry
+#define FAKE_EC_COLUMNS 26
+
+struct razer_fake_ec {
+    spinlock_t lock; // Protects everything below
+    struct razer_async *async; // Engine the transfers are done for
+    struct hrtimer latency_timer; // Ends the transfer in flight
+    bool get; // The transfer in flight reads the response
+    bool unlinked; // The transfer in flight was unlinked, end it without touching the EC
+    ktime_t last_packet; // When the last packet was taken
+    ktime_t ready; // Answers busy until then
+    unsigned int packets; // Packets taken so far
+    struct razer_packet response; // Answer to the last packet taken
+    __u8 zones[RAZER_FAN_ZONES][0x80][2]; // Fan / power values (args 2 and 3) by command
+    __u8 brightness;
+    __u8 effect[80]; // Args of the last effect packet
+    __u8 matrix[RAZER_MATRIX_ROWS][FAKE_EC_COLUMNS * 3]; // Uploaded custom frame
+};
+
+/**
+ * Acts on a packet and works out the response to it
+ */
+static __u8 razer_fake_ec_handle(struct razer_fake_ec *ec, struct razer_packet *response)
+{
+    __u8 id = response->command_id.id;
+    bool get = id & 0x80;
+    int zone = response->args[1] - 1;
+    int start, end;
+
+    switch (response->command_class) {
+    case 0x0d: // Fan and power
+        if (zone < 0 || zone >= RAZER_FAN_ZONES) {
+            return RAZER_CMD_FAILURE;
+        }
+        if (get) {
+            response->args[2] = ec->zones[zone][id & 0x7f][0];
+            response->args[3] = ec->zones[zone][id & 0x7f][1];
+        } else {
+            ec->zones[zone][id][0] = response->args[2];
+            ec->zones[zone][id][1] = response->args[3];
+        }
+        return RAZER_CMD_SUCCESSFUL;
+    case 0x03:
+        switch (id) {
+        case 0x03: // Brightness, at args[2] on boards that have 0x05 at args[1]
+            ec->brightness = response->args[1] == 0x05 ? response->args[2] : response->args[1];
+            return RAZER_CMD_SUCCESSFUL;
+        case 0x83:
+            response->args[response->args[1] == 0x05 ? 2 : 1] = ec->brightness;
+            return RAZER_CMD_SUCCESSFUL;
+        case 0x0a: // Matrix effect
+            memcpy(ec->effect, response->args, sizeof(ec->effect));
+            return RAZER_CMD_SUCCESSFUL;
+        case 0x0b: // Matrix row
+            start = response->args[2];
+            end = response->args[3];
+            if (response->args[1] >= RAZER_MATRIX_ROWS || end < start || end >= FAKE_EC_COLUMNS) {
+                return RAZER_CMD_FAILURE;
+            }
+            memcpy(&ec->matrix[response->args[1]][start * 3], &response->args[4], (end - start + 1) * 3);
+            return RAZER_CMD_SUCCESSFUL;
+        }
+        break;
+    }
+    return RAZER_CMD_NOT_SUPPORTED;
+}
+
+/**
+ * A packet arrives at the EC
+ *
+ * Must be called with ec->lock held
+ */
+static void razer_fake_ec_receive(struct razer_fake_ec *ec, const __u8 *buf)
+{
+    ktime_t now = ktime_get();
+
+    if (ktime_us_delta(now, ec->last_packet) < READ_ONCE(fake_ec_spacing_us)) {
+        // Too soon, the EC never sees it. The response stays the old one
+        return;
+    }
+    ec->last_packet = now;
+    ec->ready = ktime_add_us(now, READ_ONCE(fake_ec_busy_us));
+    ec->packets++;
+
+    memcpy(&ec->response, buf, RAZER_USB_REPORT_LEN);
+    if (ec->response.crc != crc(&ec->response)) {
+        ec->response.status = RAZER_CMD_FAILURE;
+    } else if (fake_ec_timeout_every && ec->packets % fake_ec_timeout_every == 0) {
+        ec->response.status = RAZER_CMD_TIMEOUT;
+    } else {
+        ec->response.status = razer_fake_ec_handle(ec, &ec->response);
+    }
+    ec->response.crc = crc(&ec->response);
+}
+
+/**
+ * Reads the response of the last packet. Busy if it is still being worked on
+ *
+ * Must be called with ec->lock held
+ */
+static void razer_fake_ec_respond(struct razer_fake_ec *ec, __u8 *buf)
+{
+    struct razer_packet *response = (struct razer_packet *) buf;
+
+    memcpy(buf, &ec->response, RAZER_USB_REPORT_LEN);
+    if (ktime_before(ktime_get(), ec->ready)) {
+        response->status = RAZER_CMD_BUSY;
+    }
+}
+
+static void razer_fake_ec_transfer(struct razer_fake_ec *ec, bool get, __u8 *buf)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&ec->lock, flags);
+    if (get) {
+        razer_fake_ec_respond(ec, buf);
+    } else {
+        razer_fake_ec_receive(ec, buf);
+    }
+    spin_unlock_irqrestore(&ec->lock, flags);
+}
+
+static enum hrtimer_restart razer_fake_ec_latency_done(struct hrtimer *timer)
+{
+    struct razer_fake_ec *ec = container_of(timer, struct razer_fake_ec, latency_timer);
+
+    if (ec->unlinked) {
+        razer_async_transfer_done(ec->async, -ECONNRESET, 0);
+        return HRTIMER_NORESTART;
+    }
+    // The engine leaves the buffer alone until the transfer is done
+    razer_fake_ec_transfer(ec, ec->get, ec->async->buf);
+    razer_async_transfer_done(ec->async, 0, RAZER_USB_REPORT_LEN);
+    return HRTIMER_NORESTART;
+}
+
+static int razer_fake_ec_init(struct razer_async *async)
+{
+    struct razer_fake_ec *ec;
+
+    ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+    if (!ec) {
+        return -ENOMEM;
+    }
+    spin_lock_init(&ec->lock);
+    ec->async = async;
+    hrtimer_init(&ec->latency_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    ec->latency_timer.function = razer_fake_ec_latency_done;
+    async->transport_data = ec;
+    async->allocations++;
+
+    dev_info(&async->usb_dev->dev, "Razer laptop control: Using the simulated EC, nothing is sent to the laptop");
+    return 0;
+}
+
+static void razer_fake_ec_destroy(struct razer_async *async)
+{
+    struct razer_fake_ec *ec = async->transport_data;
+
+    hrtimer_cancel(&ec->latency_timer);
+    kfree(ec);
+}
+
+static int razer_fake_ec_submit(struct razer_async *async, bool get)
+{
+    struct razer_fake_ec *ec = async->transport_data;
+
+    ec->get = get;
+    ec->unlinked = false;
+    hrtimer_start(&ec->latency_timer, ns_to_ktime((__u64) READ_ONCE(fake_ec_latency_us) * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL_SOFT);
+    return 0;
+}
+
+static void razer_fake_ec_kill(struct razer_async *async)
+{
+    struct razer_fake_ec *ec = async->transport_data;
+
+    // Same as a killed URB, the transfer still ends
+    if (hrtimer_cancel(&ec->latency_timer)) {
+        razer_async_transfer_done(async, -ENOENT, 0);
+    }
+}
+
+static void razer_fake_ec_unlink(struct razer_async *async)
+{
+    struct razer_fake_ec *ec = async->transport_data;
+
+    // Same as usb_unlink_urb, the transfer ends right away but not from here
+    if (hrtimer_try_to_cancel(&ec->latency_timer) == 1) {
+        ec->unlinked = true;
+        hrtimer_start(&ec->latency_timer, 0, HRTIMER_MODE_REL_SOFT);
+    }
+}
+
+unsigned int razer_fake_ec_packets(struct razer_async *async)
+{
+    struct razer_fake_ec *ec = async->transport_data;
+    unsigned long flags;
+    unsigned int packets;
+
+    spin_lock_irqsave(&ec->lock, flags);
+    packets = ec->packets;
+    spin_unlock_irqrestore(&ec->lock, flags);
+    return packets;
+}
+
+const struct razer_transport_ops razer_fake_ec_transport = {
+    .name = "fake_ec",
+    .init = razer_fake_ec_init,
+    .destroy = razer_fake_ec_destroy,
+    .submit = razer_fake_ec_submit,
+    .kill = razer_fake_ec_kill,
+    .unlink = razer_fake_ec_unlink,
+};
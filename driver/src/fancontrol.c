@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <linux/hwmon.h>
 #include "fancontrol.h"
 #include "core.h"
 
@@ -68,236 +69,558 @@ static int boost_mode_allowed(__u32 product_id)
     }
 }
 
-void set_fan_rpm(unsigned long x, struct razer_laptop *laptop) {
-    mutex_lock(&laptop->lock);
-    if(laptop->power_mode < 4) // custom mode do not support fan profile
-    {
-        u8 request_fan_speed;
-        struct razer_packet report = {0};
-        /* char buffer[90] = {0x00}; */
-        if (x != 0) {
-            request_fan_speed = clamp_fan_rpm(x, laptop->product_id);
-            laptop->fan_rpm = request_fan_speed * 100;
-            // All packets
-            report = get_razer_report(0x0d, 0x82, 0x04);
-#if 0
-            buffer[0] = 0x00;
-            buffer[1] = 0x1f;
-            buffer[2] = 0x00;
-            buffer[3] = 0x00;
-            buffer[4] = 0x00;
-
-            // Unknown
-            buffer[5] = 0x04;
-            buffer[6] = 0x0d;
-            buffer[7] = 0x82;
-            buffer[8] = 0x00;
-            buffer[9] = 0x01;
-            buffer[10] = 0x00;
-            buffer[11] = 0x00;
-#endif
-            // get current power mode
-            report.args[0] = 0x00;
-            report.args[1] = 0x01;
-            report.args[2] = 0x00;
-            report.args[3] = 0x00;
-            send_payload(laptop->usb_dev, &report);
-
-            report = get_razer_report(0x0d, 0x02, 0x04);
-#if 0
-            // Unknown
-            buffer[5] = 0x04;
-            buffer[6] = 0x0d;
-            buffer[7] = 0x02;
-            buffer[8] = 0x00;
-            buffer[9] = 0x01;
-            buffer[10] = laptop->power_mode;
-            buffer[11] = laptop->fan_rpm != 0 ? 0x01 : 0x00;
-
-#endif
-            // set current power mode with custom rpm
-            report.args[0] = 0x00;
-            report.args[1] = 0x01;
-            report.args[2] = laptop->power_mode;
-            report.args[3] = laptop->fan_rpm != 0 ? 0x01 : 0x00;
-            send_payload(laptop->usb_dev, &report);
-
-            report = get_razer_report(0x0d, 0x01, 0x03);
-#if 0
-            // Set fan RPM
-            buffer[5] = 0x03;
-            buffer[6] = 0x0d;
-            buffer[7] = 0x01;
-            buffer[8] = 0x00;
-            buffer[9] = 0x01;
-            buffer[10] = request_fan_speed;
-            buffer[11] = 0x00;
-#endif
-            report.args[0] = 0x00;
-            report.args[1] = 0x01;
-            report.args[2] = request_fan_speed;
-            send_payload(laptop->usb_dev, &report);
-
-            report = get_razer_report(0x0d, 0x82, 0x04);
-#if 0
-            // Unknown
-            buffer[5] = 0x04;
-            buffer[6] = 0x0d;
-            buffer[7] = 0x82;
-            buffer[8] = 0x00;
-            buffer[9] = 0x02;
-            buffer[10] = 0x00;
-            buffer[11] = 0x00;
-#endif
-            report.args[0] = 0x00;
-            report.args[1] = 0x02;
-            report.args[2] = 0x00;
-            report.args[3] = 0x00;
-            send_payload(laptop->usb_dev, &report);
+/*
+ * Returns the state the EC should be in for the requested power state
+ */
+static void razer_power_target(struct razer_laptop *laptop, const struct razer_power_state *power, struct razer_zone_state target[RAZER_FAN_ZONES])
+{
+    int zone;
+
+    for (zone = 0; zone < RAZER_FAN_ZONES; zone++) {
+        target[zone].power_mode = power->power_mode;
+        // Custom mode does not support a fan profile
+        target[zone].fan_manual = power->power_mode != 4 && power->fan_rpm != 0;
+        target[zone].fan_rpm = target[zone].fan_manual ? clamp_fan_rpm(power->fan_rpm, laptop->product_id) : 0;
+        target[zone].boost = zone == 0 ? power->cpu_boost : power->gpu_boost;
+    }
+}
+
+static void razer_plan_add(struct razer_power_plan *plan, unsigned char command_id, unsigned char data_size, __u8 zone, __u8 arg2, __u8 arg3)
+{
+    struct razer_packet *report = &plan->packets[plan->count++];
+
+    *report = get_razer_report(0x0d, command_id, data_size);
+    report->args[0] = 0x00;
+    report->args[1] = zone;
+    report->args[2] = arg2;
+    report->args[3] = arg3;
+}
+
+void razer_plan_power(struct razer_laptop *laptop, const struct razer_power_state *power, struct razer_power_plan *plan)
+{
+    struct razer_zone_state target[RAZER_FAN_ZONES];
+    struct razer_zone_state *ec;
+    bool mode_sent;
+    int zone;
+
+    razer_power_target(laptop, power, target);
+    plan->count = 0;
+    for (zone = 0; zone < RAZER_FAN_ZONES; zone++) {
+        ec = &laptop->ec.zone[zone];
+
+        // Set power mode, together with manual / auto fan. Zone 2 has always
+        // been sent 0x82 for this, not 0x02, so that is what it still gets
+        mode_sent = !(ec->known & RAZER_EC_KNOWN_MODE) ||
+                    ec->power_mode != target[zone].power_mode ||
+                    ec->fan_manual != target[zone].fan_manual;
+        if (mode_sent) {
+            razer_plan_add(plan, zone == 0 ? 0x02 : 0x82, 0x04, zone + 1, target[zone].power_mode, target[zone].fan_manual);
+        }
+
+        // Set fan RPM. The EC may drop it when the mode changes, so resend it
+        if (target[zone].fan_manual &&
+            (mode_sent || !(ec->known & RAZER_EC_KNOWN_RPM) || ec->fan_rpm != target[zone].fan_rpm)) {
+            razer_plan_add(plan, 0x01, 0x03, zone + 1, target[zone].fan_rpm, 0x00);
+        }
+
+        // Set CPU (zone 1) / GPU (zone 2) boost, same as above
+        if (target[zone].power_mode == 4 &&
+            (mode_sent || !(ec->known & RAZER_EC_KNOWN_BOOST) || ec->boost != target[zone].boost)) {
+            razer_plan_add(plan, 0x07, 0x03, zone + 1, target[zone].boost, 0x00);
+        }
+    }
+}
+
+/*
+ * Records what a packet the EC accepted changed
+ */
+static void razer_ec_commit(struct razer_laptop *laptop, const struct razer_packet *report)
+{
+    struct razer_zone_state *ec;
+    int zone = report->args[1] - 1;
+
+    if (zone < 0 || zone >= RAZER_FAN_ZONES) {
+        return;
+    }
+    ec = &laptop->ec.zone[zone];
+    switch (report->command_id.id) {
+    case 0x02:
+    case 0x82: // Zone 2's mode packet, see razer_plan_power
+        ec->power_mode = report->args[2];
+        ec->fan_manual = report->args[3];
+        ec->known |= RAZER_EC_KNOWN_MODE;
+        break;
+    case 0x01:
+        ec->fan_rpm = report->args[2];
+        ec->known |= RAZER_EC_KNOWN_RPM;
+        break;
+    case 0x07:
+        ec->boost = report->args[2];
+        ec->known |= RAZER_EC_KNOWN_BOOST;
+        break;
+    }
+}
+
+int razer_apply_power_state(struct razer_laptop *laptop, const struct razer_power_state *power)
+{
+    struct razer_power_plan plan;
+    struct razer_packet response;
+    int result = 0;
+    int i;
+
+    razer_plan_power(laptop, power, &plan);
+    for (i = 0; i < plan.count; i++) {
+        response = send_payload(laptop, &plan.packets[i]);
+        if (response.status == RAZER_CMD_SUCCESSFUL) {
+            razer_ec_commit(laptop, &plan.packets[i]);
         } else {
-            laptop->fan_rpm = 0;
+            // Don't trust anything we think we know about this zone
+            laptop->ec.zone[plan.packets[i].args[1] - 1].known = 0;
+            result = -EIO;
+        }
+    }
+    return result;
+}
+
+/*
+ * Asks the EC for one value of a zone. Returns false if it didn't answer
+ */
+static bool razer_ec_query(struct razer_laptop *laptop, unsigned char command_id, unsigned char data_size, int zone, struct razer_packet *response)
+{
+    struct razer_packet request = get_razer_report(0x0d, command_id, data_size);
+
+    request.args[0] = 0x00;
+    request.args[1] = zone + 1;
+    *response = send_payload(laptop, &request);
+    return response->status == RAZER_CMD_SUCCESSFUL;
+}
+
+int razer_read_power_state(struct razer_laptop *laptop)
+{
+    struct razer_packet response;
+    struct razer_zone_state *ec;
+    int zone;
+
+    for (zone = 0; zone < RAZER_FAN_ZONES; zone++) {
+        ec = &laptop->ec.zone[zone];
+        ec->known = 0;
+
+        // Power mode, together with manual / auto fan
+        if (!razer_ec_query(laptop, 0x82, 0x04, zone, &response)) {
+            continue;
         }
-        // Fan mode
-        report = get_razer_report(0x0d, 0x82, 0x04);
-#if 0
-        buffer[5] = 0x04;
-        buffer[6] = 0x0d;
-        buffer[7] = 0x02;
-        buffer[8] = 0x00;
-        buffer[9] = 0x02;
-        buffer[10] = laptop->power_mode;
-        buffer[11] = laptop->fan_rpm != 0 ? 0x01 : 0x00;
-#endif
-        report.args[0] = 0x00;
-        report.args[1] = 0x02;
-        report.args[2] = laptop->power_mode;
-        report.args[3] = laptop->fan_rpm != 0 ? 0x01 : 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        if (x != 0) {
-            // Set fan RPM
-            report = get_razer_report(0x0d, 0x01, 0x03);
-#if 0
-            buffer[5] = 0x03;
-            buffer[6] = 0x0d;
-            buffer[7] = 0x01;
-            buffer[8] = 0x00;
-            buffer[9] = 0x02;
-            buffer[10] = request_fan_speed;
-            buffer[11] = 0x00;
-#endif
-            report.args[0] = 0x00;
-            report.args[1] = 0x02;
-            report.args[2] = request_fan_speed;
-            send_payload(laptop->usb_dev, &report);
+        ec->power_mode = response.args[2];
+        ec->fan_manual = response.args[3];
+        ec->known |= RAZER_EC_KNOWN_MODE;
+
+        if (ec->fan_manual && razer_ec_query(laptop, 0x81, 0x03, zone, &response)) {
+            ec->fan_rpm = response.args[2];
+            ec->known |= RAZER_EC_KNOWN_RPM;
+        }
+        if (ec->power_mode == 4 && razer_ec_query(laptop, 0x87, 0x03, zone, &response)) {
+            ec->boost = response.args[2];
+            ec->known |= RAZER_EC_KNOWN_BOOST;
         }
     }
-    mutex_unlock(&laptop->lock);
+
+    if (!(laptop->ec.zone[0].known & RAZER_EC_KNOWN_MODE)) {
+        laptop->power_notified = laptop->power;
+        return -EIO;
+    }
+    // Publish what the EC is doing as the requested state, zone 1 leads.
+    // Unless the user has asked for something already, that goes first
+    mutex_lock(&laptop->power_lock);
+    if (laptop->power_requested) {
+        mutex_unlock(&laptop->power_lock);
+        return 0;
+    }
+    laptop->power.power_mode = laptop->ec.zone[0].power_mode;
+    laptop->power.fan_rpm = laptop->ec.zone[0].known & RAZER_EC_KNOWN_RPM ? laptop->ec.zone[0].fan_rpm * 100 : 0;
+    if (laptop->ec.zone[0].known & RAZER_EC_KNOWN_BOOST) {
+        laptop->power.cpu_boost = laptop->ec.zone[0].boost;
+    }
+    if (laptop->ec.zone[1].known & RAZER_EC_KNOWN_BOOST) {
+        laptop->power.gpu_boost = laptop->ec.zone[1].boost;
+    }
+    mutex_unlock(&laptop->power_lock);
+    laptop->power_notified = laptop->power;
+    return 0;
+}
+
+/*
+ * Wakes up anyone polling the attributes of what the EC just confirmed
+ */
+static void razer_power_notify(struct razer_laptop *laptop, const struct razer_power_state *power)
+{
+    struct razer_power_state *old = &laptop->power_notified;
+    struct kobject *kobj = &laptop->dev->kobj;
+
+    if (!memcmp(old, power, sizeof(*power))) {
+        return;
+    }
+    if (old->fan_rpm != power->fan_rpm) {
+        sysfs_notify(kobj, NULL, "fan_rpm");
+    }
+    if (old->power_mode != power->power_mode) {
+        sysfs_notify(kobj, NULL, "power_mode");
+    }
+    if (old->cpu_boost != power->cpu_boost) {
+        sysfs_notify(kobj, NULL, "cpu_boost");
+    }
+    if (old->gpu_boost != power->gpu_boost) {
+        sysfs_notify(kobj, NULL, "gpu_boost");
+    }
+    sysfs_notify(kobj, NULL, "power_profile");
+    *old = *power;
+}
+
+/*
+ * Applies the newest requested power state. Writes that came in while the
+ * work was pending are all covered by one run
+ */
+static void razer_power_work(struct work_struct *work)
+{
+    struct razer_laptop *laptop = container_of(work, struct razer_laptop, power_work);
+    struct razer_power_state power;
+    __u64 requested;
+    int result;
+
+    // Don't plan against an EC state that is still being read
+    wait_for_completion(&laptop->ec_read);
+
+    mutex_lock(&laptop->power_lock);
+    power = laptop->power;
+    requested = laptop->power_requested;
+    mutex_unlock(&laptop->power_lock);
+
+    result = razer_apply_power_state(laptop, &power);
+    if (result == 0) {
+        razer_power_notify(laptop, &power);
+    }
+
+    mutex_lock(&laptop->power_lock);
+    laptop->power_result = result;
+    laptop->power_applied = requested;
+    mutex_unlock(&laptop->power_lock);
+    wake_up_all(&laptop->power_wait);
+}
+
+/*
+ * Schedules laptop->power to be sent. Must be called with laptop->power_lock held
+ */
+static void razer_request_power_state(struct razer_laptop *laptop)
+{
+    laptop->power_requested++;
+    schedule_work(&laptop->power_work);
+}
+
+int razer_power_replay(struct razer_laptop *laptop)
+{
+    mutex_lock(&laptop->power_lock);
+    // Forget what the EC had confirmed, so every value is sent again
+    memset(&laptop->ec, 0, sizeof(laptop->ec));
+    razer_request_power_state(laptop);
+    mutex_unlock(&laptop->power_lock);
+    flush_work(&laptop->power_work);
+    return READ_ONCE(laptop->power_result);
+}
+
+void razer_power_init(struct razer_laptop *laptop)
+{
+    mutex_init(&laptop->power_lock);
+    INIT_WORK(&laptop->power_work, razer_power_work);
+    init_completion(&laptop->ec_read);
+    init_waitqueue_head(&laptop->power_wait);
+    laptop->power_requested = 0;
+    laptop->power_applied = 0;
+    laptop->power_result = 0;
+}
+
+static bool razer_power_applied(struct razer_laptop *laptop, __u64 requested)
+{
+    bool applied;
+
+    mutex_lock(&laptop->power_lock);
+    applied = laptop->power_applied >= requested;
+    mutex_unlock(&laptop->power_lock);
+    return applied;
+}
+
+int razer_power_sync(struct razer_laptop *laptop)
+{
+    __u64 requested;
+    int rc;
+
+    mutex_lock(&laptop->power_lock);
+    requested = laptop->power_requested;
+    mutex_unlock(&laptop->power_lock);
+
+    rc = wait_event_interruptible(laptop->power_wait, razer_power_applied(laptop, requested));
+    if (rc) {
+        return rc;
+    }
+    return READ_ONCE(laptop->power_result);
+}
+
+void set_fan_rpm(unsigned long x, struct razer_laptop *laptop) {
+    mutex_lock(&laptop->power_lock);
+    if(laptop->power.power_mode < 4) // custom mode do not support fan profile
+    {
+        laptop->power.fan_rpm = x != 0 ? clamp_fan_rpm(x, laptop->product_id) * 100 : 0;
+        razer_request_power_state(laptop);
+    }
+    mutex_unlock(&laptop->power_lock);
 }
 
 int set_power_mode(unsigned long x, struct razer_laptop *laptop) {
-    mutex_lock(&laptop->lock);
-    if (x >= 0 && x <= 2) {
-        struct razer_packet report = {0};
+    mutex_lock(&laptop->power_lock);
+    if (x <= 2 || x == 4) {
         // Device doesn't support creator mode
         if (x == 2 && !creator_mode_allowed(laptop->product_id)) {
             x = 1;
         }
+        laptop->power.power_mode = x;
+        razer_request_power_state(laptop);
+    }
+    mutex_unlock(&laptop->power_lock);
+
+    return 0;
+}
 
-        laptop->power_mode = x;
-        report = get_razer_report(0x0d, 0x02, 0x04);
-        report.args[0] = 0x00;
-        report.args[1] = 0x01;
-        report.args[2] = laptop->power_mode;
-        report.args[3] = laptop->fan_rpm != 0 ? 0x01 : 0x00; // Custom RPM ?
-        send_payload(laptop->usb_dev, &report);
+/*
+ * Checks a whole power state against what the laptop supports
+ */
+static bool razer_power_state_valid(const struct razer_power_state *power, __u32 product_id)
+{
+    if (power->power_mode > 4 || power->power_mode == 3) {
+        return false;
     }
-    else if(x == 4)
-    {
-        laptop->power_mode = x;
+    if (power->power_mode == 2 && !creator_mode_allowed(product_id)) {
+        return false;
+    }
+    if (power->cpu_boost > 3 || (power->cpu_boost == 3 && !boost_mode_allowed(product_id))) {
+        return false;
     }
-    mutex_unlock(&laptop->lock);
+    if (power->gpu_boost > 2) {
+        return false;
+    }
+    if (power->fan_rpm != 0) {
+        // Custom mode does not support a fan profile
+        if (power->power_mode == 4) {
+            return false;
+        }
+        if (power->fan_rpm < ABSOLUTE_MIN_FAN_RPM || power->fan_rpm > get_max_fan_rpm(product_id)) {
+            return false;
+        }
+    }
+    return true;
+}
 
+int set_power_profile(const struct razer_power_state *profile, struct razer_laptop *laptop)
+{
+    if (!razer_power_state_valid(profile, laptop->product_id)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&laptop->power_lock);
+    laptop->power = *profile;
+    // Same granularity as set_fan_rpm
+    laptop->power.fan_rpm = profile->fan_rpm / 100 * 100;
+    razer_request_power_state(laptop);
+    mutex_unlock(&laptop->power_lock);
     return 0;
 }
 
 int set_custom_power_mode(unsigned long cpu_boost, unsigned long gpu_boost, struct razer_laptop *laptop)
 {
-    mutex_lock(&laptop->lock);
-    if(laptop->power_mode == 4)
+    mutex_lock(&laptop->power_lock);
+    if(laptop->power.power_mode == 4)
     {
-        struct razer_packet report = {0};
         if(cpu_boost == 3 && !boost_mode_allowed(laptop->product_id))
         {
             cpu_boost = 2;
         }
+        laptop->power.cpu_boost = cpu_boost;
+        laptop->power.gpu_boost = gpu_boost;
+        razer_request_power_state(laptop);
+    }
+    mutex_unlock(&laptop->power_lock);
 
-        // TODO read power mode if already set directly set cpu and gpu boost
-        laptop->cpu_boost = cpu_boost;
-        laptop->gpu_boost = gpu_boost;
-        // read power mode
-        report = get_razer_report(0x0d, 0x82, 0x04);
-        report.args[0] = 0x00;
-        report.args[1] = 0x01;
-        report.args[2] = 0x00;
-        report.args[3] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        report = get_razer_report(0x0d, 0x02, 0x04);
-
-        // set power mode
-        report.args[0] = 0x00;
-        report.args[1] = 0x01;
-        report.args[2] = laptop->power_mode;
-        report.args[3] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        // Read cpu boost
-        report = get_razer_report(0x0d, 0x87, 0x03);
-        report.args[0] = 0x00;
-        report.args[1] = 0x01;
-        report.args[2] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        // Set cpu boost
-        report = get_razer_report(0x0d, 0x07, 0x03);
-        report.args[0] = 0x00;
-        report.args[1] = 0x01;
-        report.args[2] = laptop->cpu_boost;
-        send_payload(laptop->usb_dev, &report);
-
-        report = get_razer_report(0x0d, 0x87, 0x03);
-        // Read gpu boost
-        report.args[0] = 0x00;
-        report.args[1] = 0x02;
-        report.args[2] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        report = get_razer_report(0x0d, 0x07, 0x03);
-        // Set gpu boost
-        report.args[0] = 0x00;
-        report.args[1] = 0x02;
-        report.args[2] = laptop->gpu_boost;
-        send_payload(laptop->usb_dev, &report);
-
-        report = get_razer_report(0x0d, 0x82, 0x04);
-        // read
-        report.args[0] = 0x00;
-        report.args[1] = 0x02;
-        report.args[2] = 0x00;
-        report.args[3] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-
-        report = get_razer_report(0x0d, 0x82, 0x04);
-        // read
-        report.args[0] = 0x00;
-        report.args[1] = 0x02;
-        report.args[2] = laptop->power_mode;
-        report.args[3] = 0x00;
-        send_payload(laptop->usb_dev, &report);
-    }
-    mutex_unlock(&laptop->lock);
-
-    // always 0 since send_payload return only 0
+    // always 0, the EC is updated in the background
     return 0;
 }
+
+void set_cpu_boost(unsigned long cpu_boost, struct razer_laptop *laptop)
+{
+    mutex_lock(&laptop->power_lock);
+    if (laptop->power.power_mode == 4) {
+        if (cpu_boost == 3 && !boost_mode_allowed(laptop->product_id)) {
+            cpu_boost = 2;
+        }
+        laptop->power.cpu_boost = cpu_boost;
+        razer_request_power_state(laptop);
+    }
+    mutex_unlock(&laptop->power_lock);
+}
+
+void set_gpu_boost(unsigned long gpu_boost, struct razer_laptop *laptop)
+{
+    mutex_lock(&laptop->power_lock);
+    if (laptop->power.power_mode == 4) {
+        laptop->power.gpu_boost = gpu_boost;
+        razer_request_power_state(laptop);
+    }
+    mutex_unlock(&laptop->power_lock);
+}
+
+static umode_t razer_hwmon_is_visible(const void *data, enum hwmon_sensor_types type, u32 attr, int channel)
+{
+    switch (type) {
+    case hwmon_fan:
+        switch (attr) {
+        case hwmon_fan_target:
+            return 0644;
+        case hwmon_fan_min:
+        case hwmon_fan_max:
+        case hwmon_fan_label:
+            return 0444;
+        default:
+            return 0;
+        }
+    case hwmon_pwm:
+        return attr == hwmon_pwm_enable ? 0644 : 0;
+    default:
+        return 0;
+    }
+}
+
+static int razer_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *val)
+{
+    struct razer_laptop *laptop = dev_get_drvdata(dev);
+    int rpm;
+
+    if (type == hwmon_pwm && attr == hwmon_pwm_enable) {
+        // 0 = full speed, 1 = manual, 2 = automatic (the EC decides)
+        rpm = READ_ONCE(laptop->power.fan_rpm);
+        if (!rpm) {
+            *val = 2;
+        } else if (rpm == get_max_fan_rpm(laptop->product_id) && READ_ONCE(laptop->fan_full_speed)) {
+            *val = 0;
+        } else {
+            *val = 1;
+        }
+        return 0;
+    }
+    if (type != hwmon_fan) {
+        return -EOPNOTSUPP;
+    }
+    switch (attr) {
+    case hwmon_fan_target:
+        // 0 in automatic mode
+        *val = READ_ONCE(laptop->power.fan_rpm);
+        return 0;
+    case hwmon_fan_min:
+        *val = ABSOLUTE_MIN_FAN_RPM;
+        return 0;
+    case hwmon_fan_max:
+        *val = get_max_fan_rpm(laptop->product_id);
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+static int razer_hwmon_read_string(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, const char **str)
+{
+    *str = channel == 0 ? "cpu" : "gpu";
+    return 0;
+}
+
+/*
+ * Both zones always run the same manual RPM, so the fan and pwm attributes of
+ * either channel control both fans
+ */
+static int razer_hwmon_write(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long val)
+{
+    struct razer_laptop *laptop = dev_get_drvdata(dev);
+    int max_rpm = get_max_fan_rpm(laptop->product_id);
+
+    // Custom mode does not support a fan profile
+    if (READ_ONCE(laptop->power.power_mode) == 4) {
+        return -EBUSY;
+    }
+    if (type == hwmon_fan && attr == hwmon_fan_target) {
+        if (val < 0) {
+            return -EINVAL;
+        }
+        WRITE_ONCE(laptop->fan_full_speed, false);
+        set_fan_rpm(clamp_val(val, ABSOLUTE_MIN_FAN_RPM, max_rpm), laptop);
+        return 0;
+    }
+    if (type != hwmon_pwm || attr != hwmon_pwm_enable) {
+        return -EOPNOTSUPP;
+    }
+    if (val < 0 || val > 2) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(laptop->fan_full_speed, val == 0);
+    switch (val) {
+    case 0: // No speed control. The EC has no such mode, so run manual at the highest RPM
+        set_fan_rpm(max_rpm, laptop);
+        return 0;
+    case 1: // Manual. Coming from automatic the speed isn't known, so start at full speed
+        if (!READ_ONCE(laptop->power.fan_rpm)) {
+            set_fan_rpm(max_rpm, laptop);
+        }
+        return 0;
+    case 2: // Automatic
+        set_fan_rpm(0, laptop);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static const struct hwmon_ops razer_hwmon_ops = {
+    .is_visible = razer_hwmon_is_visible,
+    .read = razer_hwmon_read,
+    .read_string = razer_hwmon_read_string,
+    .write = razer_hwmon_write,
+};
+
+static const struct hwmon_channel_info * const razer_hwmon_info[] = {
+    HWMON_CHANNEL_INFO(fan,
+                       HWMON_F_TARGET | HWMON_F_MIN | HWMON_F_MAX | HWMON_F_LABEL,
+                       HWMON_F_TARGET | HWMON_F_MIN | HWMON_F_MAX | HWMON_F_LABEL),
+    HWMON_CHANNEL_INFO(pwm,
+                       HWMON_PWM_ENABLE,
+                       HWMON_PWM_ENABLE),
+    NULL
+};
+
+static const struct hwmon_chip_info razer_hwmon_chip_info = {
+    .ops = &razer_hwmon_ops,
+    .info = razer_hwmon_info,
+};
+
+int razer_hwmon_register(struct razer_laptop *laptop)
+{
+    struct device *hwmon;
+
+    laptop->fan_full_speed = false;
+    hwmon = hwmon_device_register_with_info(laptop->dev, "razerlaptop", laptop, &razer_hwmon_chip_info, NULL);
+    if (IS_ERR(hwmon)) {
+        laptop->hwmon = NULL;
+        return PTR_ERR(hwmon);
+    }
+    laptop->hwmon = hwmon;
+    return 0;
+}
+
+void razer_hwmon_unregister(struct razer_laptop *laptop)
+{
+    if (laptop->hwmon) {
+        hwmon_device_unregister(laptop->hwmon);
+        laptop->hwmon = NULL;
+    }
+}
@@ -4,10 +4,13 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
 #include "fancontrol.h"
 #include "defines.h"
 #include "core.h"
 #include "chroma.h"
+#include "async.h"
+#include "stats.h"
 
 
 MODULE_AUTHOR("Ashcon Mohseninia");
@@ -15,8 +18,16 @@ MODULE_DESCRIPTION("Razer system control driver for laptops");
 MODULE_LICENSE("GPL");
 MODULE_VERSION("1.3.0");
 
-static int loaded = 0;
-static razer_laptop laptop = {0x00};
+static unsigned int brightness_cache_ms = 5000;
+module_param(brightness_cache_ms, uint, 0644);
+MODULE_PARM_DESC(brightness_cache_ms, "How long (ms) a cached keyboard brightness is trusted before asking the EC again. 0 = forever");
+
+static bool fake_ec;
+module_param(fake_ec, bool, 0444);
+MODULE_PARM_DESC(fake_ec, "Talk to a simulated EC instead of the laptop (for testing the driver)");
+
+// Holds one directory per device
+static struct dentry *debugfs_root;
 
 
 /**
@@ -31,30 +42,256 @@ static razer_laptop laptop = {0x00};
  *  Row 5: CTRL - FN
  *
  * This function takes RGB data and sends it to each row in the keyboard.
- * We expect 360 bytes (4 bytes per key), send in order row 0, key 0 to row 5, key 14.
+ * We expect 270 bytes (3 bytes per key), send in order row 0, key 0 to row 5, key 14.
+ *
+ * Only the keys that changed since the last frame are sent. The rows are
+ * staged on the packet engine, which uploads them in the background, so this
+ * returns as soon as the data is copied.
+ *
+ * Any frames still waiting in key_colour_queue are dropped.
  */
 static ssize_t key_colour_map_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
-	int i;
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
 	if (count != 270) {
 		dev_err(dev, "RGB Map expects 270 bytes. Got %ld Bytes", count);
 		return -EINVAL;
 	}
-	mutex_lock(&laptop.lock);
-	for (i = 0; i <= 5; i++) {
-		memcpy(&matrix[i].keys, &buf[i*45], 45);
-		sendRowDataToProfile(laptop.usb_dev, i);
+	razer_frame_queue_flush(&laptop->frame_queue);
+	mutex_lock(&laptop->lock);
+	sendMatrixFrame(laptop, buf);
+	mutex_unlock(&laptop->lock);
+	return count;
+}
+
+/**
+ * Changes a few keys of one row without sending a whole frame. Takes the row
+ * (0-5), the first and last key (0-14) and 3 bytes (red, green, blue) for
+ * each key in between, so a single key is 6 bytes and one packet.
+ *
+ * The keys are changed in the frame that is displayed, any frames still
+ * waiting in key_colour_queue are dropped.
+ */
+static ssize_t key_colour_span_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+	const __u8 *span = buf;
+
+	if (count < 6 || span[0] >= RAZER_MATRIX_ROWS || span[1] > span[2] || span[2] > 14 ||
+	    count != 3 + (span[2] - span[1] + 1) * 3) {
+		dev_err(dev, "Key span expects row, start key, end key and 3 bytes per key. Got %ld Bytes", count);
+		return -EINVAL;
 	}
-	displayProfile(laptop.usb_dev, 0);
-	mutex_unlock(&laptop.lock);
+	razer_frame_queue_flush(&laptop->frame_queue);
+	mutex_lock(&laptop->lock);
+	sendKeySpan(laptop, span[0], span[1], span[2], &span[3]);
+	mutex_unlock(&laptop->lock);
 	return count;
 }
 
+/**
+ * The frame buffer itself. Frame 0 is at offset 0, frame 1 at offset
+ * PAGE_SIZE. Meant to be mmap'ed, but can be read and written as well.
+ *
+ * Writing or mapping it only changes memory, nothing is sent until the back
+ * frame is presented with key_colour_flip.
+ */
+static ssize_t key_colour_fb_read(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(kobj_to_dev(kobj));
+
+	memcpy(buf, laptop->fb.mem + off, count);
+	return count;
+}
+
+static ssize_t key_colour_fb_write(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(kobj_to_dev(kobj));
+
+	memcpy(laptop->fb.mem + off, buf, count);
+	return count;
+}
+
+static int key_colour_fb_mmap(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, struct vm_area_struct *vma)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(kobj_to_dev(kobj));
+
+	return remap_vmalloc_range(vma, laptop->fb.mem, vma->vm_pgoff);
+}
+
+/**
+ * Reading returns the index (0 or 1) of the back frame, the one to draw into.
+ * Writing anything presents the back frame. After the flip the back frame is
+ * the previous front frame, so it holds the frame before the one just shown.
+ * Any frames still waiting in key_colour_queue are dropped.
+ */
+static ssize_t key_colour_flip_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", laptop->fb.back);
+}
+
+static ssize_t key_colour_flip_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	razer_frame_queue_flush(&laptop->frame_queue);
+	mutex_lock(&laptop->lock);
+	flipMatrixFrame(laptop);
+	mutex_unlock(&laptop->lock);
+	return count;
+}
+
+/**
+ * Queues frames to be shown later, so animations don't depend on when the
+ * writer gets scheduled. Takes one or more struct razer_timed_frame records
+ * (8 byte CLOCK_MONOTONIC time in ns, then 270 bytes like key_colour_map).
+ * At most 14 frames fit in one write.
+ *
+ * Frames are drawn through the back frame of key_colour_fb.
+ */
+static ssize_t key_colour_queue_write(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(kobj_to_dev(kobj));
+	int frames = count / sizeof(struct razer_timed_frame);
+	int queued;
+
+	if (count % sizeof(struct razer_timed_frame)) {
+		dev_err(kobj_to_dev(kobj), "Frame queue expects records of %zu bytes. Got %zu Bytes", sizeof(struct razer_timed_frame), count);
+		return -EINVAL;
+	}
+	queued = razer_frame_queue_push(&laptop->frame_queue, (struct razer_timed_frame *) buf, frames);
+	if (queued == 0) {
+		return -EAGAIN;
+	}
+	return queued * sizeof(struct razer_timed_frame);
+}
+
+/**
+ * Returns the number of frames in key_colour_queue that haven't been shown yet
+ */
+static ssize_t key_colour_queued_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", razer_frame_queue_count(&laptop->frame_queue));
+}
+
+/**
+ * Switches to one of the EC's built in effects. Once running it needs no CPU
+ * time or USB traffic at all. Any frames still waiting in key_colour_queue are
+ * dropped, and the next frame written is sent in full.
+ */
+static ssize_t matrix_effect_apply(struct device *dev, __u8 effect, const __u8 *args, int arg_count, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+	int rc;
+
+	razer_frame_queue_flush(&laptop->frame_queue);
+	mutex_lock(&laptop->lock);
+	rc = sendMatrixEffect(laptop, effect, args, arg_count);
+	mutex_unlock(&laptop->lock);
+	return rc ? rc : count;
+}
+
+/**
+ * Writing anything turns the keyboard matrix off
+ */
+static ssize_t matrix_effect_none_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	return matrix_effect_apply(dev, RAZER_EFFECT_NONE, NULL, 0, count);
+}
+
+/**
+ * Takes 3 bytes: red, green, blue
+ */
+static ssize_t matrix_effect_static_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	if (count != 3) {
+		dev_err(dev, "Static effect expects 3 bytes. Got %ld Bytes", count);
+		return -EINVAL;
+	}
+	return matrix_effect_apply(dev, RAZER_EFFECT_STATIC, buf, 3, count);
+}
+
+/**
+ * Takes 1 byte for random colours, 3 bytes (red, green, blue) for one colour,
+ * or 6 bytes for two alternating colours
+ */
+static ssize_t matrix_effect_breath_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	__u8 args[RAZER_EFFECT_MAX_ARGS] = {0};
+
+	switch (count) {
+	case 1:
+		args[0] = 0x03;
+		break;
+	case 3:
+		args[0] = 0x01;
+		break;
+	case 6:
+		args[0] = 0x02;
+		break;
+	default:
+		dev_err(dev, "Breathing effect expects 1, 3 or 6 bytes. Got %ld Bytes", count);
+		return -EINVAL;
+	}
+	if (count > 1) {
+		memcpy(&args[1], buf, count);
+	}
+	return matrix_effect_apply(dev, RAZER_EFFECT_BREATHING, args, RAZER_EFFECT_MAX_ARGS, count);
+}
+
+/**
+ * Takes the direction of the wave, 1 (left to right) or 2 (right to left)
+ */
+static ssize_t matrix_effect_wave_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long x;
+	__u8 direction;
+
+	if (kstrtol(buf, 10, &x) || (x != 1 && x != 2)) {
+		#ifdef DEBUG
+		dev_warn(dev, "User entered an invalid wave direction.");
+		#endif
+		return -EINVAL;
+	}
+	direction = x;
+	return matrix_effect_apply(dev, RAZER_EFFECT_WAVE, &direction, 1, count);
+}
+
+/**
+ * Writing anything cycles the whole keyboard through all colours
+ */
+static ssize_t matrix_effect_spectrum_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	return matrix_effect_apply(dev, RAZER_EFFECT_SPECTRUM, NULL, 0, count);
+}
+
+/**
+ * Takes 4 bytes: speed (1 = fastest fade, 4 = slowest), red, green, blue.
+ * Keys light up when pressed and fade out
+ */
+static ssize_t matrix_effect_reactive_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	if (count != 4) {
+		dev_err(dev, "Reactive effect expects 4 bytes. Got %ld Bytes", count);
+		return -EINVAL;
+	}
+	if (buf[0] < 1 || buf[0] > 4) {
+		return -EINVAL;
+	}
+	return matrix_effect_apply(dev, RAZER_EFFECT_REACTIVE, buf, 4, count);
+}
+
 /**
  * Returns the name of the device
  */
 static ssize_t product_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%s\n", getDeviceDescription(laptop.product_id));
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", getDeviceDescription(laptop->product_id));
 }
 
 /**
@@ -62,7 +299,9 @@ static ssize_t product_show(struct device *dev, struct device_attribute *attr, c
  */
 static ssize_t fan_rpm_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%d\n", laptop.fan_rpm);
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", laptop->power.fan_rpm);
 }
 
 /**
@@ -70,19 +309,23 @@ static ssize_t fan_rpm_show(struct device *dev, struct device_attribute *attr, c
  */
 static ssize_t power_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%d\n", laptop.power_mode);
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", laptop->power.power_mode);
 }
 
 static ssize_t fan_rpm_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
 	unsigned long x;
+
 	if (kstrtol(buf, 10, &x)) { // Convert users input to integer
         #ifdef DEBUG
 		dev_warn(dev, "User entered an invalid input for fan rpm.");
         #endif
 		return -EINVAL;
 	}
-	set_fan_rpm(x, &laptop);
+	set_fan_rpm(x, laptop);
 	return count;
 }
 
@@ -98,7 +341,9 @@ static ssize_t fan_rpm_store(struct device *dev, struct device_attribute *attr,
  */
 static ssize_t power_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
 	unsigned long x;
+
 	if (kstrtol(buf, 10, &x)) {
 		#ifdef DEBUG
 		dev_warn(dev, "User entered an invalid input for power mode. Defaulting to balanced");
@@ -106,21 +351,24 @@ static ssize_t power_mode_store(struct device *dev, struct device_attribute *att
 		return -EINVAL;
 	}
 
-    set_power_mode(x, &laptop);
-    set_custom_power_mode(laptop.cpu_boost, laptop.gpu_boost, &laptop);
+    set_power_mode(x, laptop);
 
 	return count;
 }
 
 static ssize_t cpu_boost_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%d\n", laptop.cpu_boost);
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", laptop->power.cpu_boost);
 }
 
 
 static ssize_t cpu_boost_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
 	unsigned long x;
+
 	if (kstrtol(buf, 10, &x)) {
 		#ifdef DEBUG
 		dev_warn(dev, "User entered an invalid input for power mode. Defaulting to balanced");
@@ -128,20 +376,24 @@ static ssize_t cpu_boost_store(struct device *dev, struct device_attribute *attr
 		return -EINVAL;
 	}
 
-    set_custom_power_mode(x, laptop.gpu_boost, &laptop);
+    set_cpu_boost(x, laptop);
 
 	return count;
 }
 
 static ssize_t gpu_boost_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%d\n", laptop.gpu_boost);
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", laptop->power.gpu_boost);
 }
 
 
 static ssize_t gpu_boost_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
 	unsigned long x;
+
 	if (kstrtol(buf, 10, &x)) {
 		#ifdef DEBUG
 		dev_warn(dev, "User entered an invalid input for power mode. Defaulting to balanced");
@@ -149,39 +401,265 @@ static ssize_t gpu_boost_store(struct device *dev, struct device_attribute *attr
 		return -EINVAL;
 	}
 
-    set_custom_power_mode(laptop.cpu_boost, x, &laptop);
+    set_gpu_boost(x, laptop);
 
 	return count;
 }
 
+/**
+ * The whole power state in one go: "power_mode cpu_boost gpu_boost fan_rpm".
+ * A write is only accepted if every value is supported by the laptop, and it
+ * reaches the EC as a single burst of only the packets that are needed
+ */
+static ssize_t power_profile_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+	struct razer_power_state power;
+
+	mutex_lock(&laptop->power_lock);
+	power = laptop->power;
+	mutex_unlock(&laptop->power_lock);
+	return sprintf(buf, "%u %u %u %u\n", power.power_mode, power.cpu_boost, power.gpu_boost, power.fan_rpm);
+}
+
+static ssize_t power_profile_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+	struct razer_power_state profile;
+	unsigned int mode, cpu_boost, gpu_boost, fan_rpm;
+	int rc;
+
+	if (sscanf(buf, "%u %u %u %u", &mode, &cpu_boost, &gpu_boost, &fan_rpm) != 4 ||
+	    mode > 0xff || cpu_boost > 0xff || gpu_boost > 0xff || fan_rpm > 0xffff) {
+		#ifdef DEBUG
+		dev_warn(dev, "User entered an invalid power profile.");
+		#endif
+		return -EINVAL;
+	}
+	profile.power_mode = mode;
+	profile.cpu_boost = cpu_boost;
+	profile.gpu_boost = gpu_boost;
+	profile.fan_rpm = fan_rpm;
+
+	rc = set_power_profile(&profile, laptop);
+	return rc ? rc : count;
+}
+
+/**
+ * Writing anything waits until every fan / power change written so far has
+ * reached the EC. Fails with EIO if the EC refused part of it
+ */
+static ssize_t sync_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct razer_laptop *laptop = dev_get_drvdata(dev);
+	int rc = razer_power_sync(laptop);
+
+	return rc ? rc : count;
+}
+
 // Set our device attributes in sysfs
 static DEVICE_ATTR_RW(fan_rpm);
 static DEVICE_ATTR_RW(power_mode);
 static DEVICE_ATTR_RW(cpu_boost);
 static DEVICE_ATTR_RW(gpu_boost);
 static DEVICE_ATTR_WO(key_colour_map);
+static DEVICE_ATTR_WO(key_colour_span);
+static DEVICE_ATTR_RW(key_colour_flip);
+static DEVICE_ATTR_RO(key_colour_queued);
 static DEVICE_ATTR_RO(product);
+static DEVICE_ATTR_WO(sync);
+static DEVICE_ATTR_WO(matrix_effect_none);
+static DEVICE_ATTR_WO(matrix_effect_static);
+static DEVICE_ATTR_WO(matrix_effect_breath);
+static DEVICE_ATTR_WO(matrix_effect_wave);
+static DEVICE_ATTR_WO(matrix_effect_spectrum);
+static DEVICE_ATTR_WO(matrix_effect_reactive);
+static DEVICE_ATTR_RW(power_profile);
+
+static struct bin_attribute bin_attr_key_colour_fb = {
+	.attr = { .name = "key_colour_fb", .mode = 0600 },
+	.size = RAZER_FB_SIZE,
+	.read = key_colour_fb_read,
+	.write = key_colour_fb_write,
+	.mmap = key_colour_fb_mmap,
+};
+
+static struct bin_attribute bin_attr_key_colour_queue = {
+	.attr = { .name = "key_colour_queue", .mode = 0200 },
+	.size = 0,
+	.write = key_colour_queue_write,
+};
 
 static int backlight_sysfs_set(struct led_classdev *led_cdev, enum led_brightness brightness) {
-    return sendBrightness(laptop.usb_dev, (__u8) brightness);
+    struct razer_laptop *laptop = container_of(led_cdev, struct razer_laptop, kbd_backlight);
+
+    // Setting a brightness ends any blinking
+    razer_ramp_stop(laptop);
+    return sendBrightness(laptop, (__u8) brightness);
 }
 
-static enum led_brightness backlight_sysfs_get(struct led_classdev *ledclass) {
-    return getBrightness(laptop.usb_dev);
+/**
+ * Blinking is run by the driver's ramp worker, so the LED core doesn't send a
+ * blocking brightness command from a timer for every toggle
+ */
+static int backlight_blink_set(struct led_classdev *led_cdev, unsigned long *delay_on, unsigned long *delay_off) {
+    struct razer_laptop *laptop = container_of(led_cdev, struct razer_laptop, kbd_backlight);
+    int on = READ_ONCE(laptop->brightness.value);
+    struct led_pattern steps[4];
+
+    // Blink at the brightness the backlight had, or full if it was off
+    if (!READ_ONCE(laptop->brightness.valid) || on == 0) {
+        on = led_cdev->max_brightness;
+    }
+
+    if (*delay_on == 0 && *delay_off == 0) {
+        *delay_on = 500;
+        *delay_off = 500;
+    }
+    // Hold on, jump to off, hold off, jump back on
+    steps[0].brightness = on;
+    steps[0].delta_t = *delay_on;
+    steps[1].brightness = on;
+    steps[1].delta_t = 0;
+    steps[2].brightness = 0;
+    steps[2].delta_t = *delay_off;
+    steps[3].brightness = 0;
+    steps[3].delta_t = 0;
+    return razer_ramp_start(laptop, steps, 4, -1);
 }
 
-static struct led_classdev kbd_backlight = {
-        .name = "razerlaptop::kbd_backlight",
-        .max_brightness = 255,
-        .flags = LED_BRIGHT_HW_CHANGED,
-        .brightness_set_blocking = &backlight_sysfs_set,
-        .brightness_get	= &backlight_sysfs_get,
-};
+/**
+ * Hardware pattern (hw_pattern of the pattern trigger). The brightness fades
+ * from each step to the next over the delta_t of the step, a step with a
+ * delta_t of 0 jumps straight to the next one
+ */
+static int backlight_pattern_set(struct led_classdev *led_cdev, struct led_pattern *pattern, u32 len, int repeat) {
+    struct razer_laptop *laptop = container_of(led_cdev, struct razer_laptop, kbd_backlight);
+
+    return razer_ramp_start(laptop, pattern, len, repeat);
+}
+
+static int backlight_pattern_clear(struct led_classdev *led_cdev) {
+    struct razer_laptop *laptop = container_of(led_cdev, struct razer_laptop, kbd_backlight);
 
-// Called on module load
+    razer_ramp_stop(laptop);
+    return 0;
+}
+
+static enum led_brightness backlight_sysfs_get(struct led_classdev *led_cdev) {
+    struct razer_laptop *laptop = container_of(led_cdev, struct razer_laptop, kbd_backlight);
+
+    // init_work reads it from the EC, don't ask it from here before that
+    if (!completion_done(&laptop->ec_read)) {
+        return led_cdev->brightness;
+    }
+    return getCachedBrightness(laptop, READ_ONCE(brightness_cache_ms));
+}
+
+static void razer_laptop_create_files(struct hid_device *hdev) {
+    device_create_file(&hdev->dev, &dev_attr_fan_rpm);
+    device_create_file(&hdev->dev, &dev_attr_power_mode);
+    device_create_file(&hdev->dev, &dev_attr_cpu_boost);
+    device_create_file(&hdev->dev, &dev_attr_gpu_boost);
+    device_create_file(&hdev->dev, &dev_attr_key_colour_map);
+    device_create_file(&hdev->dev, &dev_attr_key_colour_span);
+    device_create_file(&hdev->dev, &dev_attr_key_colour_flip);
+    device_create_bin_file(&hdev->dev, &bin_attr_key_colour_fb);
+    device_create_bin_file(&hdev->dev, &bin_attr_key_colour_queue);
+    device_create_file(&hdev->dev, &dev_attr_key_colour_queued);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_none);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_static);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_breath);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_wave);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_spectrum);
+    device_create_file(&hdev->dev, &dev_attr_matrix_effect_reactive);
+    device_create_file(&hdev->dev, &dev_attr_product);
+    device_create_file(&hdev->dev, &dev_attr_sync);
+    device_create_file(&hdev->dev, &dev_attr_power_profile);
+}
+
+static void razer_laptop_remove_files(struct hid_device *hdev) {
+    device_remove_file(&hdev->dev, &dev_attr_fan_rpm);
+    device_remove_file(&hdev->dev, &dev_attr_power_mode);
+    device_remove_file(&hdev->dev, &dev_attr_cpu_boost);
+    device_remove_file(&hdev->dev, &dev_attr_gpu_boost);
+    device_remove_file(&hdev->dev, &dev_attr_key_colour_map);
+    device_remove_file(&hdev->dev, &dev_attr_key_colour_span);
+    device_remove_file(&hdev->dev, &dev_attr_key_colour_flip);
+    device_remove_bin_file(&hdev->dev, &bin_attr_key_colour_fb);
+    device_remove_bin_file(&hdev->dev, &bin_attr_key_colour_queue);
+    device_remove_file(&hdev->dev, &dev_attr_key_colour_queued);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_none);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_static);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_breath);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_wave);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_spectrum);
+    device_remove_file(&hdev->dev, &dev_attr_matrix_effect_reactive);
+    device_remove_file(&hdev->dev, &dev_attr_product);
+    device_remove_file(&hdev->dev, &dev_attr_sync);
+    device_remove_file(&hdev->dev, &dev_attr_power_profile);
+}
+
+static void razer_laptop_create_debugfs(struct razer_laptop *laptop, struct hid_device *hdev) {
+    struct dentry *dir = debugfs_create_dir(dev_name(&hdev->dev), debugfs_root);
+
+    laptop->debugfs_dir = dir;
+    debugfs_create_u64("matrix_frames", 0444, dir, &laptop->matrix_stats.frames);
+    debugfs_create_u64("matrix_rows_sent", 0444, dir, &laptop->matrix_stats.rows_sent);
+    debugfs_create_u64("matrix_rows_skipped", 0444, dir, &laptop->matrix_stats.rows_skipped);
+    debugfs_create_u32("matrix_last_rows_sent", 0444, dir, &laptop->matrix_stats.last_rows_sent);
+    debugfs_create_u32("matrix_last_rows_skipped", 0444, dir, &laptop->matrix_stats.last_rows_skipped);
+    debugfs_create_u64("queue_frames_presented", 0444, dir, &laptop->frame_queue.presented);
+    debugfs_create_u64("queue_frames_dropped", 0444, dir, &laptop->frame_queue.dropped);
+    debugfs_create_u32("pacing_spacing_us", 0444, dir, &laptop->pacing.spacing_us);
+    debugfs_create_u64("pacing_busy_retries", 0444, dir, &laptop->pacing.busy_retries);
+    debugfs_create_u64("pacing_busy_failures", 0444, dir, &laptop->pacing.busy_failures);
+    debugfs_create_u64("pacing_mismatches", 0444, dir, &laptop->pacing.mismatches);
+    debugfs_create_u64("pacing_resends", 0444, dir, &laptop->pacing.resends);
+    debugfs_create_u64("engine_transfers", 0444, dir, &laptop->async.transfers);
+    debugfs_create_u64("engine_allocations", 0444, dir, &laptop->async.allocations);
+    razer_stats_debugfs(&laptop->stats, dir);
+}
+
+/**
+ * Reads what the EC is doing. Done after probe, so an EC that doesn't answer
+ * can't hold probe up. Power changes wait for it
+ */
+static void razer_laptop_init_work(struct work_struct *work) {
+    struct razer_laptop *laptop = container_of(work, struct razer_laptop, init_work);
+
+    if (razer_async_check_echo(&laptop->async)) {
+        dev_warn(laptop->dev, "Failed to check the EC's transaction ids\n");
+    }
+    // The EC keeps its state over a module reload or warm reboot, so ask it
+    if (razer_read_power_state(laptop)) {
+        dev_warn(laptop->dev, "Failed to read power state, assuming defaults\n");
+    }
+    // The only brightness read, later reads are served from the cache
+    getBrightness(laptop);
+    complete_all(&laptop->ec_read);
+}
+
+/**
+ * Stops and frees everything probe set up, in reverse order
+ */
+static void razer_laptop_destroy(struct razer_laptop *laptop) {
+    flush_work(&laptop->init_work);
+    razer_hwmon_unregister(laptop);
+    // Let the last power change reach the EC
+    flush_work(&laptop->power_work);
+    debugfs_remove_recursive(laptop->debugfs_dir);
+    led_classdev_unregister(&laptop->kbd_backlight);
+    razer_ramp_stop(laptop);
+    razer_frame_queue_destroy(&laptop->frame_queue);
+    razer_async_destroy(&laptop->async);
+    razer_fb_destroy(&laptop->fb);
+}
+
+// Called for every interface of a supported laptop
 static int razer_laptop_probe(struct hid_device *hdev, const struct hid_device_id *id) {
-    int i;
     int rc;
+    struct razer_laptop *laptop;
     struct usb_interface *intf;
     struct usb_device *usb_dev;
     intf = to_usb_interface(hdev->dev.parent);
@@ -194,45 +672,80 @@ static int razer_laptop_probe(struct hid_device *hdev, const struct hid_device_i
     }
     dev_info(&intf->dev, "Found supported laptop: %s\n", getDeviceDescription(hdev->product));
 
-    mutex_init(&laptop.lock);
-    // When the driver first loads (At boot), we know these will be the default values:
-    laptop.fan_rpm = 0; // Auto
-    laptop.power_mode = 0; // Normal
-    laptop.cpu_boost = 1; // equal to Normal
-    laptop.gpu_boost = 1; // equal to Normal
-    laptop.product_id = hdev->product; // Product id
-    laptop.usb_dev = usb_dev;
-
-    for (i = 0; i < 6; i++) { // Label all the keyboard rows
-        laptop.kbd.rows[i].rowid = i;
+    laptop = devm_kzalloc(&hdev->dev, sizeof(*laptop), GFP_KERNEL);
+    if (!laptop) {
+        return -ENOMEM;
     }
-
-    // Create SYSFS entries
-    device_create_file(&hdev->dev, &dev_attr_fan_rpm);
-    device_create_file(&hdev->dev, &dev_attr_power_mode);
-    device_create_file(&hdev->dev, &dev_attr_cpu_boost);
-    device_create_file(&hdev->dev, &dev_attr_gpu_boost);
-    device_create_file(&hdev->dev, &dev_attr_key_colour_map);
-    device_create_file(&hdev->dev, &dev_attr_product);
-
-    // Now init the backlight stuff - Only do it once!
-    if (!loaded) {
-        rc = led_classdev_register(&intf->dev, &kbd_backlight);
-        if (rc < 0) {
-            hid_err(hdev, "Failed to setup backlight!\n");
-            return rc;
-        }
+    mutex_init(&laptop->lock);
+    razer_power_init(laptop);
+    // The EC's defaults at boot, used if it can't tell us what it is doing:
+    laptop->power.fan_rpm = 0; // Auto
+    laptop->power.power_mode = 0; // Normal
+    laptop->power.cpu_boost = 1; // equal to Normal
+    laptop->power.gpu_boost = 1; // equal to Normal
+    // Nothing confirmed by the EC yet, laptop->ec is zeroed
+    laptop->product_id = hdev->product; // Product id
+    laptop->usb_dev = usb_dev;
+    laptop->dev = &hdev->dev;
+    laptop->transport = fake_ec ? &razer_fake_ec_transport : &razer_usb_transport;
+    invalidateBrightnessCache(laptop);
+    razer_ramp_init(laptop);
+    INIT_WORK(&laptop->init_work, razer_laptop_init_work);
+
+    // Now init the backlight, frame buffer and packet engine
+    rc = razer_fb_init(&laptop->fb);
+    if (rc < 0) {
+        hid_err(hdev, "Failed to allocate frame buffer!\n");
+        return rc;
+    }
+    razer_frame_queue_init(&laptop->frame_queue);
+    razer_pacing_init(&laptop->pacing);
+    razer_stats_init(&laptop->stats);
+    rc = razer_async_init(&laptop->async, usb_dev, laptop->transport, &laptop->pacing, &laptop->stats);
+    if (rc < 0) {
+        hid_err(hdev, "Failed to setup packet engine!\n");
+        razer_fb_destroy(&laptop->fb);
+        return rc;
+    }
+    // Named after the HID device, so a second keyboard gets its own LED
+    snprintf(laptop->kbd_backlight_name, sizeof(laptop->kbd_backlight_name),
+             "razerlaptop-%s::kbd_backlight", dev_name(&hdev->dev));
+    laptop->kbd_backlight.name = laptop->kbd_backlight_name;
+    laptop->kbd_backlight.max_brightness = 255;
+    laptop->kbd_backlight.flags = LED_BRIGHT_HW_CHANGED;
+    laptop->kbd_backlight.brightness_set_blocking = &backlight_sysfs_set;
+    laptop->kbd_backlight.brightness_get = &backlight_sysfs_get;
+    laptop->kbd_backlight.blink_set = &backlight_blink_set;
+    laptop->kbd_backlight.pattern_set = &backlight_pattern_set;
+    laptop->kbd_backlight.pattern_clear = &backlight_pattern_clear;
+    rc = led_classdev_register(&intf->dev, &laptop->kbd_backlight);
+    if (rc < 0) {
+        hid_err(hdev, "Failed to setup backlight!\n");
+        razer_frame_queue_destroy(&laptop->frame_queue);
+        razer_async_destroy(&laptop->async);
+        razer_fb_destroy(&laptop->fb);
+        return rc;
+    }
+    razer_laptop_create_debugfs(laptop, hdev);
+    schedule_work(&laptop->init_work);
+
+    // Now set driver data, the sysfs entries rely on it
+    hid_set_drvdata(hdev, laptop);
+    razer_laptop_create_files(hdev);
+    if (razer_hwmon_register(laptop)) {
+        hid_warn(hdev, "Failed to register hwmon device\n");
     }
-    loaded = 1;
 
-    // Now set driver data
-    hid_set_drvdata(hdev, &laptop);
     if (hid_parse(hdev)) {
         hid_err(hdev, "Failed to parse device!\n");
+        razer_laptop_remove_files(hdev);
+        razer_laptop_destroy(laptop);
         return -ENODEV;
     }
     if (hid_hw_start(hdev, HID_CONNECT_DEFAULT)) {
         hid_err(hdev, "Failed to start device!\n");
+        razer_laptop_remove_files(hdev);
+        razer_laptop_destroy(laptop);
         return -ENODEV;
     }
     return 0;
@@ -240,20 +753,85 @@ static int razer_laptop_probe(struct hid_device *hdev, const struct hid_device_i
 
 // Called on unload
 static void razer_laptop_remove(struct hid_device *hdev) {
+    struct razer_laptop *laptop = hid_get_drvdata(hdev);
 
-    device_remove_file(&hdev->dev, &dev_attr_fan_rpm);
-    device_remove_file(&hdev->dev, &dev_attr_power_mode);
-    device_remove_file(&hdev->dev, &dev_attr_cpu_boost);
-    device_remove_file(&hdev->dev, &dev_attr_gpu_boost);
-    device_remove_file(&hdev->dev, &dev_attr_key_colour_map);
-    device_remove_file(&hdev->dev, &dev_attr_product);
-    if (loaded) { // Ensure this only happens once!
-        led_classdev_unregister(&kbd_backlight);
-        loaded = 0;
-    }
+    razer_laptop_remove_files(hdev);
+    razer_laptop_destroy(laptop);
     hid_hw_stop(hdev);
 }
 
+#ifdef CONFIG_PM
+static int razer_laptop_suspend(struct hid_device *hdev, pm_message_t message) {
+    struct razer_laptop *laptop = hid_get_drvdata(hdev);
+
+    // An autosuspended EC stays powered and keeps its state
+    laptop->auto_suspended = PMSG_IS_AUTO(message);
+
+    // Finish whatever is on its way to the EC, then keep the engine quiet
+    razer_frame_queue_flush(&laptop->frame_queue);
+    razer_ramp_pause(laptop);
+    flush_work(&laptop->init_work);
+    flush_work(&laptop->power_work);
+    razer_async_halt(&laptop->async);
+    return 0;
+}
+
+/**
+ * The EC may have lost everything we sent it while we were asleep, so send it
+ * all again in one go: power state first, then the backlight, then the frame
+ * or the built in effect the keyboard was running.
+ * Not needed after an autosuspend. A paused backlight pattern picks up again
+ * either way
+ */
+static int razer_laptop_resume(struct hid_device *hdev) {
+    struct razer_laptop *laptop = hid_get_drvdata(hdev);
+
+    razer_async_resume(&laptop->async);
+
+    if (laptop->auto_suspended) {
+        razer_ramp_resume(laptop);
+        return 0;
+    }
+
+    if (razer_power_replay(laptop)) {
+        hid_warn(hdev, "Failed to restore power state\n");
+    }
+
+    if (READ_ONCE(laptop->brightness.valid)) {
+        sendBrightness(laptop, READ_ONCE(laptop->brightness.value));
+    } else {
+        invalidateBrightnessCache(laptop);
+    }
+
+    mutex_lock(&laptop->lock);
+    if (laptop->fb.valid) {
+        displayMatrix(laptop);
+        displayProfile(laptop, 0);
+    } else if (laptop->effect.valid) {
+        // The arguments are copied first, sendMatrixEffect stores them again
+        struct razer_matrix_effect effect = laptop->effect;
+
+        if (sendMatrixEffect(laptop, effect.effect, effect.args, effect.arg_count)) {
+            hid_warn(hdev, "Failed to restore matrix effect\n");
+        }
+    }
+    mutex_unlock(&laptop->lock);
+
+    razer_ramp_resume(laptop);
+    return 0;
+}
+
+/**
+ * The device was reset, so whatever kind of suspend it was, the EC lost its state
+ */
+static int razer_laptop_reset_resume(struct hid_device *hdev) {
+    struct razer_laptop *laptop = hid_get_drvdata(hdev);
+
+    laptop->auto_suspended = false;
+    return razer_laptop_resume(hdev);
+}
+#endif
+
 // Support list for module
 static const struct hid_device_id table[] = {
         // 14"
@@ -300,6 +878,29 @@ static struct hid_driver razer_sc_driver = {
 	.name = "Razer laptop System control driver",
 	.probe = razer_laptop_probe,
 	.remove = razer_laptop_remove,
+#ifdef CONFIG_PM
+	.suspend = razer_laptop_suspend,
+	.resume = razer_laptop_resume,
+	.reset_resume = razer_laptop_reset_resume,
+#endif
 	.id_table = table,
 };
-module_hid_driver(razer_sc_driver);
+
+static int __init razer_laptop_init(void) {
+    int rc;
+
+    debugfs_root = debugfs_create_dir("razercontrol", NULL);
+    rc = hid_register_driver(&razer_sc_driver);
+    if (rc) {
+        debugfs_remove_recursive(debugfs_root);
+    }
+    return rc;
+}
+
+static void __exit razer_laptop_exit(void) {
+    hid_unregister_driver(&razer_sc_driver);
+    debugfs_remove_recursive(debugfs_root);
+}
+
+module_init(razer_laptop_init);
+module_exit(razer_laptop_exit);
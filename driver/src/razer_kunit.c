@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <kunit/test.h>
+#include <linux/slab.h>
+#include "chroma.h"
+#include "stats.h"
+
+/*
+ * KUnit suite, built in with `make kunit` and run whenever the module is
+ * loaded on a CONFIG_KUNIT kernel. Every test gets its own laptop talking to
+ * the simulated EC, so no hardware is needed and the numbers can be compared
+ * from one build to the next. The bounds assume the simulated EC's default
+ * timings.
+ */
+
+// Time one packet may take on the simulated EC, with room for a loaded VM
+#define RAZER_KUNIT_PACKET_BUDGET_US 5000
+
+// How long to wait for the engine to send everything that was staged
+#define RAZER_KUNIT_DRAIN_MS 1000
+
+static bool razer_kunit_drained(struct razer_async *async)
+{
+    unsigned long flags;
+    bool drained;
+
+    spin_lock_irqsave(&async->lock, flags);
+    drained = !async->busy && !async->pending_rows && !async->pending_display;
+    spin_unlock_irqrestore(&async->lock, flags);
+    return drained;
+}
+
+/*
+ * Waits until every staged frame packet has gone out
+ */
+static void razer_kunit_drain(struct kunit *test, struct razer_laptop *laptop)
+{
+    long left = wait_event_timeout(laptop->async.idle_wait, razer_kunit_drained(&laptop->async),
+                                   msecs_to_jiffies(RAZER_KUNIT_DRAIN_MS));
+
+    KUNIT_ASSERT_GT_MSG(test, left, 0L, "Packet engine never went idle");
+}
+
+static int razer_kunit_init(struct kunit *test)
+{
+    struct razer_laptop *laptop;
+    struct usb_device *usb_dev;
+    int rc;
+
+    // Only there for the engine's log messages
+    usb_dev = kunit_kzalloc(test, sizeof(*usb_dev), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, usb_dev);
+    usb_dev->dev.init_name = "razer-kunit";
+
+    laptop = kunit_kzalloc(test, sizeof(*laptop), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, laptop);
+    mutex_init(&laptop->lock);
+    razer_power_init(laptop);
+    laptop->power.cpu_boost = 1;
+    laptop->power.gpu_boost = 1;
+    laptop->product_id = BLADE_2021_ADV;
+    laptop->usb_dev = usb_dev;
+    laptop->dev = &usb_dev->dev;
+    laptop->transport = &razer_fake_ec_transport;
+
+    rc = razer_fb_init(&laptop->fb);
+    KUNIT_ASSERT_EQ(test, rc, 0);
+    razer_pacing_init(&laptop->pacing);
+    razer_stats_init(&laptop->stats);
+    rc = razer_async_init(&laptop->async, usb_dev, laptop->transport, &laptop->pacing, &laptop->stats);
+    if (rc) {
+        razer_fb_destroy(&laptop->fb);
+    }
+    KUNIT_ASSERT_EQ(test, rc, 0);
+    // Same as probe. The simulated EC echoes the ids
+    KUNIT_EXPECT_EQ(test, razer_async_check_echo(&laptop->async), 0);
+    KUNIT_EXPECT_TRUE(test, laptop->async.echo_transaction);
+    // That was init_work's job, so power changes don't wait for it
+    complete_all(&laptop->ec_read);
+
+    test->priv = laptop;
+    return 0;
+}
+
+static void razer_kunit_exit(struct kunit *test)
+{
+    struct razer_laptop *laptop = test->priv;
+
+    razer_async_destroy(&laptop->async);
+    razer_fb_destroy(&laptop->fb);
+}
+
+/*
+ * Uploads a frame and returns the number of packets the EC took for it.
+ * *elapsed_us is set to the time until the last one was sent
+ */
+static int razer_kunit_frame(struct kunit *test, struct razer_laptop *laptop, const char *frame, s64 *elapsed_us)
+{
+    unsigned int packets = razer_fake_ec_packets(&laptop->async);
+    ktime_t start = ktime_get();
+
+    mutex_lock(&laptop->lock);
+    sendMatrixFrame(laptop, frame);
+    mutex_unlock(&laptop->lock);
+    razer_kunit_drain(test, laptop);
+    *elapsed_us = ktime_us_delta(ktime_get(), start);
+    return (int) (razer_fake_ec_packets(&laptop->async) - packets);
+}
+
+static void razer_kunit_packets_per_frame(struct kunit *test)
+{
+    struct razer_laptop *laptop = test->priv;
+    char *frame = kunit_kzalloc(test, RAZER_FRAME_LEN, GFP_KERNEL);
+    __u64 allocations = laptop->async.allocations;
+    __u64 transfers = laptop->async.transfers;
+    s64 elapsed_us;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frame);
+    memset(frame, 0x40, RAZER_FRAME_LEN);
+
+    // Nothing sent yet, so every row goes out, then the display packet
+    KUNIT_EXPECT_EQ(test, razer_kunit_frame(test, laptop, frame, &elapsed_us), RAZER_MATRIX_ROWS + 1);
+    KUNIT_EXPECT_EQ(test, (int) laptop->matrix_stats.last_rows_sent, RAZER_MATRIX_ROWS);
+
+    // The EC already shows this frame
+    KUNIT_EXPECT_EQ(test, razer_kunit_frame(test, laptop, frame, &elapsed_us), 0);
+    KUNIT_EXPECT_EQ(test, (int) laptop->matrix_stats.last_rows_skipped, RAZER_MATRIX_ROWS);
+
+    // One key changed: its row, covering just that key, and the display packet
+    frame[2 * 45 + 7 * 3] = 0xff;
+    KUNIT_EXPECT_EQ(test, razer_kunit_frame(test, laptop, frame, &elapsed_us), 2);
+    KUNIT_EXPECT_EQ(test, laptop->fb.staged_start[2], 7);
+    KUNIT_EXPECT_EQ(test, laptop->fb.staged_end[2], 7);
+
+    // All of it out of the engine's buffer
+    KUNIT_EXPECT_EQ(test, laptop->async.transfers - transfers, (__u64) RAZER_MATRIX_ROWS + 1 + 2);
+    KUNIT_EXPECT_EQ(test, laptop->async.allocations, allocations);
+}
+
+static void razer_kunit_frame_latency(struct kunit *test)
+{
+    struct razer_laptop *laptop = test->priv;
+    char *frame = kunit_kzalloc(test, RAZER_FRAME_LEN, GFP_KERNEL);
+    int packets;
+    s64 elapsed_us;
+
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frame);
+    memset(frame, 0x80, RAZER_FRAME_LEN);
+
+    packets = razer_kunit_frame(test, laptop, frame, &elapsed_us);
+    kunit_info(test, "full frame: %d packets in %lld us\n", packets, elapsed_us);
+    KUNIT_EXPECT_LT(test, elapsed_us, (s64) (RAZER_MATRIX_ROWS + 1) * RAZER_KUNIT_PACKET_BUDGET_US);
+
+    frame[0] = 0x00;
+    packets = razer_kunit_frame(test, laptop, frame, &elapsed_us);
+    kunit_info(test, "one key: %d packets in %lld us\n", packets, elapsed_us);
+    KUNIT_EXPECT_LT(test, elapsed_us, (s64) 2 * RAZER_KUNIT_PACKET_BUDGET_US);
+}
+
+/*
+ * Applies a power state and returns the number of packets it took
+ */
+static int razer_kunit_switch(struct kunit *test, struct razer_laptop *laptop,
+                              const struct razer_power_state *profile, s64 *elapsed_us)
+{
+    unsigned int packets = razer_fake_ec_packets(&laptop->async);
+    ktime_t start = ktime_get();
+
+    KUNIT_EXPECT_EQ(test, razer_apply_power_state(laptop, profile), 0);
+    *elapsed_us = ktime_us_delta(ktime_get(), start);
+    return (int) (razer_fake_ec_packets(&laptop->async) - packets);
+}
+
+/*
+ * Checks the EC reports a power state back. Zone 1 leads. Zone 2 only ever
+ * gets 0x82 for its mode, which doesn't set anything on the simulated EC, so
+ * its boost isn't read back
+ */
+static void razer_kunit_read_back(struct kunit *test, struct razer_laptop *laptop,
+                                  const struct razer_power_state *profile)
+{
+    KUNIT_EXPECT_EQ(test, razer_read_power_state(laptop), 0);
+    KUNIT_EXPECT_EQ(test, laptop->power.power_mode, profile->power_mode);
+    KUNIT_EXPECT_EQ(test, laptop->power.fan_rpm, profile->fan_rpm);
+    if (profile->power_mode == 4) {
+        KUNIT_EXPECT_EQ(test, laptop->power.cpu_boost, profile->cpu_boost);
+    }
+}
+
+static void razer_kunit_profile_switch(struct kunit *test)
+{
+    struct razer_laptop *laptop = test->priv;
+    const struct razer_power_state custom = { .power_mode = 4, .cpu_boost = 3, .gpu_boost = 2 };
+    const struct razer_power_state manual_fan = { .power_mode = 0, .fan_rpm = 3500, .cpu_boost = 1, .gpu_boost = 1 };
+    int packets;
+    s64 elapsed_us;
+
+    // Mode and boost of both zones
+    packets = razer_kunit_switch(test, laptop, &custom, &elapsed_us);
+    kunit_info(test, "to custom: %d packets in %lld us\n", packets, elapsed_us);
+    KUNIT_EXPECT_EQ(test, packets, 4);
+    KUNIT_EXPECT_LT(test, elapsed_us, (s64) packets * RAZER_KUNIT_PACKET_BUDGET_US);
+    razer_kunit_read_back(test, laptop, &custom);
+
+    // Mode and fan RPM of both zones
+    packets = razer_kunit_switch(test, laptop, &manual_fan, &elapsed_us);
+    kunit_info(test, "to manual fan: %d packets in %lld us\n", packets, elapsed_us);
+    KUNIT_EXPECT_EQ(test, packets, 4);
+    KUNIT_EXPECT_LT(test, elapsed_us, (s64) packets * RAZER_KUNIT_PACKET_BUDGET_US);
+
+    // The EC is already there
+    packets = razer_kunit_switch(test, laptop, &manual_fan, &elapsed_us);
+    KUNIT_EXPECT_EQ(test, packets, 0);
+    razer_kunit_read_back(test, laptop, &manual_fan);
+}
+
+static struct kunit_case razer_kunit_cases[] = {
+    KUNIT_CASE(razer_kunit_packets_per_frame),
+    KUNIT_CASE(razer_kunit_frame_latency),
+    KUNIT_CASE(razer_kunit_profile_switch),
+    {}
+};
+
+static struct kunit_suite razer_kunit_suite = {
+    .name = "razercontrol",
+    .init = razer_kunit_init,
+    .exit = razer_kunit_exit,
+    .test_cases = razer_kunit_cases,
+};
+
+kunit_test_suite(razer_kunit_suite);
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM razercontrol
+
+#if !defined(RAZER_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define RAZER_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include "core.h"
+
+/**
+ * One exchange with the EC. usb_ns is the time spent in USB transfers,
+ * sleep_ns the time spent waiting for the EC between packets
+ */
+DECLARE_EVENT_CLASS(razer_ec_transfer,
+
+    TP_PROTO(const struct razer_packet *request, __u8 status, int retries, int result, __u64 usb_ns, __u64 sleep_ns),
+
+    TP_ARGS(request, status, retries, result, usb_ns, sleep_ns),
+
+    TP_STRUCT__entry(
+        __field(__u8, command_class)
+        __field(__u8, command_id)
+        __field(__u8, data_size)
+        __field(__u8, transaction_id)
+        __field(__u8, status)
+        __field(int, retries)
+        __field(int, result)
+        __field(__u64, usb_ns)
+        __field(__u64, sleep_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->command_class = request->command_class;
+        __entry->command_id = request->command_id.id;
+        __entry->data_size = request->data_size;
+        __entry->transaction_id = request->transaction_id.id;
+        __entry->status = status;
+        __entry->retries = retries;
+        __entry->result = result;
+        __entry->usb_ns = usb_ns;
+        __entry->sleep_ns = sleep_ns;
+    ),
+
+    TP_printk("class=0x%02x cmd=0x%02x size=%u txn=0x%02x status=0x%02x retries=%d result=%d usb_ns=%llu sleep_ns=%llu",
+              __entry->command_class, __entry->command_id, __entry->data_size,
+              __entry->transaction_id, __entry->status, __entry->retries,
+              __entry->result, __entry->usb_ns, __entry->sleep_ns)
+);
+
+// Whole command including busy retries (send_payload)
+DEFINE_EVENT(razer_ec_transfer, razer_ec_payload,
+    TP_PROTO(const struct razer_packet *request, __u8 status, int retries, int result, __u64 usb_ns, __u64 sleep_ns),
+    TP_ARGS(request, status, retries, result, usb_ns, sleep_ns)
+);
+
+/**
+ * A frame packet was staged. replaced is set if it took the place of one that
+ * hadn't been sent yet
+ */
+DECLARE_EVENT_CLASS(razer_frame_stage,
+
+    TP_PROTO(const struct razer_packet *packet, bool replaced),
+
+    TP_ARGS(packet, replaced),
+
+    TP_STRUCT__entry(
+        __field(__u8, command_id)
+        __field(__u8, row)
+        __field(bool, replaced)
+    ),
+
+    TP_fast_assign(
+        __entry->command_id = packet->command_id.id;
+        __entry->row = packet->args[1];
+        __entry->replaced = replaced;
+    ),
+
+    TP_printk("cmd=0x%02x row=%u replaced=%d", __entry->command_id, __entry->row, __entry->replaced)
+);
+
+// Matrix row staged (razer_async_queue_row)
+DEFINE_EVENT(razer_frame_stage, razer_frame_queue_row,
+    TP_PROTO(const struct razer_packet *packet, bool replaced),
+    TP_ARGS(packet, replaced)
+);
+
+// Display packet staged (razer_async_queue_display)
+DEFINE_EVENT(razer_frame_stage, razer_frame_queue_display,
+    TP_PROTO(const struct razer_packet *packet, bool replaced),
+    TP_ARGS(packet, replaced)
+);
+
+/**
+ * A frame packet was sent. Frame packets don't wait for a response, usb_ns is
+ * the time the transfer took
+ */
+DECLARE_EVENT_CLASS(razer_frame_transfer,
+
+    TP_PROTO(const struct razer_packet *packet, int status, __u64 usb_ns),
+
+    TP_ARGS(packet, status, usb_ns),
+
+    TP_STRUCT__entry(
+        __field(__u8, command_id)
+        __field(__u8, row)
+        __field(int, status)
+        __field(__u64, usb_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->command_id = packet->command_id.id;
+        __entry->row = packet->args[1];
+        __entry->status = status;
+        __entry->usb_ns = usb_ns;
+    ),
+
+    TP_printk("cmd=0x%02x row=%u status=%d usb_ns=%llu",
+              __entry->command_id, __entry->row, __entry->status, __entry->usb_ns)
+);
+
+// Matrix row sent
+DEFINE_EVENT(razer_frame_transfer, razer_frame_row,
+    TP_PROTO(const struct razer_packet *packet, int status, __u64 usb_ns),
+    TP_ARGS(packet, status, usb_ns)
+);
+
+// Display packet sent, the frame is on screen
+DEFINE_EVENT(razer_frame_transfer, razer_frame_display,
+    TP_PROTO(const struct razer_packet *packet, int status, __u64 usb_ns),
+    TP_ARGS(packet, status, usb_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE razer_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include "stats.h"
+
+void razer_stats_init(struct razer_stats *stats)
+{
+    spin_lock_init(&stats->lock);
+    razer_stats_reset(stats);
+}
+
+void razer_stats_reset(struct razer_stats *stats)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&stats->lock, flags);
+    stats->count = 0;
+    stats->other = 0;
+    memset(stats->cmds, 0, sizeof(stats->cmds));
+    spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+/**
+ * Finds the counters of a command, or claims a free slot for it
+ *
+ * Must be called with stats->lock held
+ */
+static struct razer_cmd_stats *razer_stats_find(struct razer_stats *stats, __u8 command_class, __u8 command_id)
+{
+    struct razer_cmd_stats *cmd;
+    int i;
+
+    for (i = 0; i < stats->count; i++) {
+        cmd = &stats->cmds[i];
+        if (cmd->command_class == command_class && cmd->command_id == command_id) {
+            return cmd;
+        }
+    }
+    if (stats->count == RAZER_STATS_COMMANDS) {
+        return NULL;
+    }
+    cmd = &stats->cmds[stats->count++];
+    cmd->command_class = command_class;
+    cmd->command_id = command_id;
+    return cmd;
+}
+
+void razer_stats_record(struct razer_stats *stats, const struct razer_packet *request, __u8 status, int result, bool mismatch, __u64 latency_ns, unsigned int bytes)
+{
+    struct razer_cmd_stats *cmd;
+    unsigned long flags;
+    __u64 latency_us = div_u64(latency_ns, NSEC_PER_USEC);
+    int bucket = latency_us ? min(ilog2(latency_us) + 1, RAZER_STATS_LATENCY_BUCKETS - 1) : 0;
+
+    spin_lock_irqsave(&stats->lock, flags);
+    cmd = razer_stats_find(stats, request->command_class, request->command_id.id);
+    if (!cmd) {
+        stats->other++;
+        spin_unlock_irqrestore(&stats->lock, flags);
+        return;
+    }
+    cmd->sent++;
+    cmd->bytes += bytes;
+    cmd->latency[bucket]++;
+    if (result) {
+        cmd->io_errors++;
+    } else if (mismatch) {
+        cmd->mismatches++;
+    } else if (status < RAZER_STATS_STATUSES) {
+        cmd->status[status]++;
+    }
+    spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+static int razer_stats_show(struct seq_file *m, void *v)
+{
+    struct razer_stats *stats = m->private;
+    struct razer_cmd_stats *cmds;
+    unsigned long flags;
+    __u64 other;
+    int count;
+    int i, j;
+
+    // Take a copy, so we don't print with interrupts disabled
+    cmds = kmalloc(sizeof(stats->cmds), GFP_KERNEL);
+    if (!cmds) {
+        return -ENOMEM;
+    }
+    spin_lock_irqsave(&stats->lock, flags);
+    count = stats->count;
+    other = stats->other;
+    memcpy(cmds, stats->cmds, count * sizeof(*cmds));
+    spin_unlock_irqrestore(&stats->lock, flags);
+
+    seq_puts(m, "class cmd  sent       bytes        new  busy success failure timeout unsupported mismatch io_error\n");
+    for (i = 0; i < count; i++) {
+        struct razer_cmd_stats *cmd = &cmds[i];
+
+        seq_printf(m, "0x%02x  0x%02x %-10llu %-12llu", cmd->command_class, cmd->command_id, cmd->sent, cmd->bytes);
+        seq_printf(m, " %-4llu %-4llu %-7llu %-7llu %-7llu %-11llu %-8llu %llu\n",
+                   cmd->status[0], cmd->status[RAZER_CMD_BUSY], cmd->status[RAZER_CMD_SUCCESSFUL],
+                   cmd->status[RAZER_CMD_FAILURE], cmd->status[RAZER_CMD_TIMEOUT],
+                   cmd->status[RAZER_CMD_NOT_SUPPORTED], cmd->mismatches, cmd->io_errors);
+    }
+    seq_printf(m, "other %llu\n", other);
+
+    // Bucket n holds transfers that took less than 2^n us
+    seq_puts(m, "\nlatency_us");
+    for (j = 0; j < RAZER_STATS_LATENCY_BUCKETS - 1; j++) {
+        seq_printf(m, " <%u", 1U << j);
+    }
+    seq_printf(m, " >=%u\n", 1U << (RAZER_STATS_LATENCY_BUCKETS - 2));
+    for (i = 0; i < count; i++) {
+        seq_printf(m, "0x%02x 0x%02x ", cmds[i].command_class, cmds[i].command_id);
+        for (j = 0; j < RAZER_STATS_LATENCY_BUCKETS; j++) {
+            seq_printf(m, " %llu", cmds[i].latency[j]);
+        }
+        seq_putc(m, '\n');
+    }
+
+    kfree(cmds);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(razer_stats);
+
+static ssize_t razer_stats_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    razer_stats_reset(file->private_data);
+    return count;
+}
+
+static const struct file_operations razer_stats_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = razer_stats_reset_write,
+};
+
+void razer_stats_debugfs(struct razer_stats *stats, struct dentry *dir)
+{
+    debugfs_create_file("stats", 0444, dir, stats, &razer_stats_fops);
+    debugfs_create_file("stats_reset", 0200, dir, stats, &razer_stats_reset_fops);
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <linux/debugfs.h>
+#include "core.h"
+
+void razer_stats_init(struct razer_stats *stats);
+
+/**
+ * Clears all counters
+ */
+void razer_stats_reset(struct razer_stats *stats);
+
+/**
+ * Counts one transfer. Safe to call from URB completion
+ *
+ * @param request Packet that was sent
+ * @param status Status of the response, 0 if the EC doesn't answer this packet
+ * @param result 0 if the transfer itself worked
+ * @param mismatch True if the response belonged to a different request
+ * @param latency_ns Time from submitting the packet to getting the response
+ * @param bytes Bytes transferred both ways
+ */
+void razer_stats_record(struct razer_stats *stats, const struct razer_packet *request, __u8 status, int result, bool mismatch, __u64 latency_ns, unsigned int bytes);
+
+/**
+ * Creates the stats and stats_reset files
+ */
+void razer_stats_debugfs(struct razer_stats *stats, struct dentry *dir);
+
+#endif
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/slab.h>
+#include "async.h"
+
+// Control URB and the setup packets of both directions
+struct razer_usb_link {
+    struct urb *urb;
+    struct usb_ctrlrequest *set_setup; // SET_REPORT setup packet
+    struct usb_ctrlrequest *get_setup; // GET_REPORT setup packet
+};
+
+static void razer_usb_complete(struct urb *urb)
+{
+    razer_async_transfer_done(urb->context, urb->status, urb->actual_length);
+}
+
+static int razer_usb_init(struct razer_async *async)
+{
+    struct razer_usb_link *link;
+
+    link = kzalloc(sizeof(*link), GFP_KERNEL);
+    if (!link) {
+        return -ENOMEM;
+    }
+    link->urb = usb_alloc_urb(0, GFP_KERNEL);
+    link->set_setup = kzalloc(sizeof(*link->set_setup), GFP_KERNEL);
+    link->get_setup = kzalloc(sizeof(*link->get_setup), GFP_KERNEL);
+    if (!link->urb || !link->set_setup || !link->get_setup) {
+        usb_free_urb(link->urb);
+        kfree(link->set_setup);
+        kfree(link->get_setup);
+        kfree(link);
+        return -ENOMEM;
+    }
+
+    // HID SET_REPORT / GET_REPORT of feature report 0x300 on interface 2
+    link->set_setup->bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT; // 0x21
+    link->set_setup->bRequest = HID_REQ_SET_REPORT; // 0x09
+    link->set_setup->wValue = cpu_to_le16(0x300);
+    link->set_setup->wIndex = cpu_to_le16(0x02);
+    link->set_setup->wLength = cpu_to_le16(RAZER_USB_REPORT_LEN);
+
+    link->get_setup->bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_IN; // 0xA1
+    link->get_setup->bRequest = HID_REQ_GET_REPORT; // 0x01
+    link->get_setup->wValue = cpu_to_le16(0x300);
+    link->get_setup->wIndex = cpu_to_le16(0x02);
+    link->get_setup->wLength = cpu_to_le16(RAZER_USB_REPORT_LEN);
+
+    async->transport_data = link;
+    async->allocations += 4; // link, URB and both setup packets
+    return 0;
+}
+
+static void razer_usb_destroy(struct razer_async *async)
+{
+    struct razer_usb_link *link = async->transport_data;
+
+    usb_free_urb(link->urb);
+    kfree(link->set_setup);
+    kfree(link->get_setup);
+    kfree(link);
+}
+
+static int razer_usb_submit(struct razer_async *async, bool get)
+{
+    struct razer_usb_link *link = async->transport_data;
+    struct usb_device *usb_dev = async->usb_dev;
+
+    if (get) {
+        usb_fill_control_urb(link->urb, usb_dev, usb_rcvctrlpipe(usb_dev, 0),
+                             (unsigned char *) link->get_setup,
+                             async->buf, RAZER_USB_REPORT_LEN,
+                             razer_usb_complete, async);
+    } else {
+        usb_fill_control_urb(link->urb, usb_dev, usb_sndctrlpipe(usb_dev, 0),
+                             (unsigned char *) link->set_setup,
+                             async->buf, RAZER_USB_REPORT_LEN,
+                             razer_usb_complete, async);
+    }
+    return usb_submit_urb(link->urb, GFP_ATOMIC);
+}
+
+static void razer_usb_kill(struct razer_async *async)
+{
+    struct razer_usb_link *link = async->transport_data;
+
+    usb_kill_urb(link->urb);
+}
+
+static void razer_usb_unlink(struct razer_async *async)
+{
+    struct razer_usb_link *link = async->transport_data;
+
+    // Completes later with -ECONNRESET
+    usb_unlink_urb(link->urb);
+}
+
+const struct razer_transport_ops razer_usb_transport = {
+    .name = "usb",
+    .init = razer_usb_init,
+    .destroy = razer_usb_destroy,
+    .submit = razer_usb_submit,
+    .kill = razer_usb_kill,
+    .unlink = razer_usb_unlink,
+};
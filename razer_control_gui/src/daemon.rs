@@ -8,9 +8,12 @@ use signal_hook::{iterator::Signals, SIGINT, SIGTERM};
 use std::io::prelude::*;
 use std::io::{Read, Write};
 use std::os::unix::net::UnixStream;
-use std::sync::Mutex;
+use std::sync::{Condvar, Mutex};
 use std::{thread, time};
 
+// How often the animator checks the power source, even with nothing to animate
+const POWER_POLL_MS: u128 = 1000;
+
 lazy_static! {
     static ref EFFECT_MANAGER: Mutex<kbd::EffectManager> = Mutex::new(kbd::EffectManager::new());
     static ref CONFIG: Mutex<config::Configuration> = {
@@ -19,10 +22,35 @@ lazy_static! {
             Err(_) => Mutex::new(config::Configuration::new()),
         }
     };
+    /// Set whenever the effects change, so the animator doesn't sleep
+    /// through them
+    static ref ANIMATOR_WAKE: (Mutex<bool>, Condvar) = (Mutex::new(false), Condvar::new());
 }
 
 fn push_effect(effect: Box<dyn Effect>, mask: [bool; 90]) {
-    EFFECT_MANAGER.lock().unwrap().push_effect(effect, mask)
+    EFFECT_MANAGER.lock().unwrap().push_effect(effect, mask);
+    wake_animator();
+}
+
+/// Makes the animator update the keyboard now, instead of at its next deadline
+fn wake_animator() {
+    let (lock, cvar) = &*ANIMATOR_WAKE;
+    *lock.lock().unwrap() = true;
+    cvar.notify_one();
+}
+
+/// Sleeps until the given time (kbd::get_millis()), or until woken up
+fn animator_sleep(until_ms: u128) {
+    let (lock, cvar) = &*ANIMATOR_WAKE;
+    let mut woken = lock.lock().unwrap();
+    let timeout = until_ms.saturating_sub(kbd::get_millis()) as u64;
+    if !*woken && timeout > 0 {
+        woken = cvar
+            .wait_timeout(woken, time::Duration::from_millis(timeout))
+            .unwrap()
+            .0;
+    }
+    *woken = false;
 }
 
 // Main function for daemon
@@ -41,17 +69,30 @@ fn main() {
     println!("Sysfs ready! Starting daemon");
 
     // Start the keyboard animator thread,
-    // This thread also periodically checks the machine power
+    // This thread also periodically checks the machine power.
+    // It only wakes up when an effect needs a new frame, the effects
+    // change, or the power source is due to be checked
     std::thread::spawn(move || {
         let mut last_psu_status : driver_sysfs::PowerSupply = driver_sysfs::PowerSupply::UNK;
+        let mut next_psu_check = kbd::get_millis();
         loop {
-            EFFECT_MANAGER.lock().unwrap().update();
-            std::thread::sleep(std::time::Duration::from_millis(kbd::ANIMATION_SLEEP_MS));
-            let new_psu = driver_sysfs::read_power_source();
-            if last_psu_status != new_psu {
-                println!("Power source changed! Now {:?}", new_psu);
+            let deadline = {
+                let mut manager = EFFECT_MANAGER.lock().unwrap();
+                manager.update();
+                manager.next_deadline()
+            };
+            if kbd::get_millis() >= next_psu_check {
+                let new_psu = driver_sysfs::read_power_source();
+                if last_psu_status != new_psu {
+                    println!("Power source changed! Now {:?}", new_psu);
+                }
+                last_psu_status = new_psu;
+                next_psu_check = kbd::get_millis() + POWER_POLL_MS;
             }
-            last_psu_status = new_psu;
+            animator_sleep(match deadline {
+                Some(t) => t.min(next_psu_check),
+                None => next_psu_check,
+            });
         }
     });
 
@@ -76,6 +117,7 @@ fn main() {
                 [true; 90]
             );
         }
+        wake_animator();
     }
 
     // Signal handler - cleanup if we are told to exit
@@ -189,6 +231,9 @@ pub fn process_client_request(cmd: comms::DaemonCommand) -> Option<comms::Daemon
                     res = false
                 }
             }
+            if res {
+                wake_animator();
+            }
             Some(comms::DaemonResponse::SetEffect{result: res})
         }
 
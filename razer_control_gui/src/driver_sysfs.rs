@@ -1,6 +1,7 @@
 use lazy_static::lazy_static;
 
 use std::fs;
+use std::path::Path;
 
 // Driver path
 pub const DRIVER_DIR: &'static str =
@@ -24,6 +25,11 @@ lazy_static! {
             Err(_) => None,
         }
     };
+    /// Older drivers can only take whole frames
+    static ref HAS_KEY_SPAN: bool = match SYSFS_PATH.clone() {
+        Some(p) => Path::new(&(p + "/key_colour_span")).exists(),
+        None => false,
+    };
 }
 
 pub fn get_path() -> Option<String> {
@@ -62,6 +68,16 @@ pub fn write_rgb_map(map: Vec<u8>) -> bool {
     return write_to_sysfs_raw("key_colour_map", map);
 }
 
+/// Returns true if the driver can update part of a row (key_colour_span)
+pub fn has_key_span() -> bool {
+    *HAS_KEY_SPAN
+}
+
+/// Writes a key span: row, first key, last key, then RGB for each key
+pub fn write_key_span(span: Vec<u8>) -> bool {
+    return write_to_sysfs_raw("key_colour_span", span);
+}
+
 // Brightness is read + write
 pub fn write_brightness(lvl: u8) -> bool {
     return write_to_sysfs("brightness", String::from(format!("{}", lvl)));
@@ -7,7 +7,7 @@ use std::ops;
 const KEYS_PER_ROW: usize = 15;
 const ROWS: usize = 6;
 
-#[derive(Copy, Clone, Debug)]
+#[derive(Copy, Clone, Debug, PartialEq)]
 /// Represents the colour channels for a key
 pub struct KeyColour {
     /// Red channel
@@ -169,6 +169,14 @@ impl RowData {
         (0..KEYS_PER_ROW).for_each(|x| self.set_key_color(x, r, g, b)) // Sets the entire row
     }
 
+    /// Returns the first and last key that differ from `other`, or None
+    /// if the rows are the same
+    pub fn changed_span(&self, other: &RowData) -> Option<(usize, usize)> {
+        let first = (0..KEYS_PER_ROW).find(|&x| self.keys[x] != other.keys[x])?;
+        let last = (0..KEYS_PER_ROW).rev().find(|&x| self.keys[x] != other.keys[x])?;
+        Some((first, last))
+    }
+
     pub fn get_row_data(&mut self) -> Vec<u8> {
         // *3 as itll be the RGB values
         let mut v = Vec::<u8>::with_capacity(3 * KEYS_PER_ROW);
@@ -208,6 +216,34 @@ impl KeyboardData {
         driver_sysfs::write_rgb_map(self.get_curr_state())
     }
 
+    /// Returns true if any key differs from `other`
+    pub fn differs_from(&self, other: &KeyboardData) -> bool {
+        (0..ROWS).any(|row| self.rows[row].changed_span(&other.rows[row]).is_some())
+    }
+
+    /// Sends only the keys that differ from `presented`, the frame the
+    /// keyboard is showing. If they all sit in one row they go out as a single
+    /// key span. Every key span is displayed on its own, so anything more goes
+    /// out as a whole frame, of which the driver only sends the changed rows
+    pub fn update_kbd_from(&mut self, presented: &KeyboardData) -> bool {
+        let spans: Vec<(usize, usize, usize)> = (0..ROWS)
+            .filter_map(|row| {
+                self.rows[row]
+                    .changed_span(&presented.rows[row])
+                    .map(|(first, last)| (row, first, last))
+            })
+            .collect();
+        match spans.as_slice() {
+            [] => true,
+            [(row, first, last)] if driver_sysfs::has_key_span() => {
+                let mut span = vec![*row as u8, *first as u8, *last as u8];
+                span.extend(&self.rows[*row].get_row_data()[first * 3..(last + 1) * 3]);
+                driver_sysfs::write_key_span(span)
+            }
+            _ => self.update_kbd(),
+        }
+    }
+
     /// Sets a specific key in the keyboard matrix to a colour
     pub fn set_key_colour(&mut self, row: usize, col: usize, r: u8, g: u8, b: u8) {
         if row >= ROWS {
@@ -29,6 +29,10 @@ impl Effect for Static {
         return self.kbd;
     }
 
+    fn next_frame(&self) -> NextFrame {
+        NextFrame::Never
+    }
+
     fn get_name() -> &'static str
     where
         Self: Sized,
@@ -92,6 +96,10 @@ impl Effect for StaticGradient {
         self.kbd // Nothing to update
     }
 
+    fn next_frame(&self) -> NextFrame {
+        NextFrame::Never
+    }
+
     fn get_name() -> &'static str
     where
         Self: Sized,
@@ -166,6 +174,11 @@ impl Effect for WaveGradient {
         self.kbd
     }
 
+    fn next_frame(&self) -> NextFrame {
+        // Moves one column per frame, so the rate sets the speed
+        NextFrame::At(get_millis() + ANIMATION_SLEEP_MS as u128)
+    }
+
     fn get_name() -> &'static str
     where
         Self: Sized,
@@ -278,6 +291,15 @@ impl Effect for BreathSingle {
         return self.kbd;
     }
 
+    fn next_frame(&self) -> NextFrame {
+        match self.curr_step {
+            // Holding a colour, nothing to do until the step is over
+            0 | 2 => NextFrame::At(self.static_start_ms + self.step_duration_ms),
+            // Fading, animator_step_colour is per ANIMATION_SLEEP_MS
+            _ => NextFrame::At(get_millis() + ANIMATION_SLEEP_MS as u128),
+        }
+    }
+
     fn get_name() -> &'static str
     where
         Self: Sized,
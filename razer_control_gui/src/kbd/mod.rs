@@ -8,6 +8,10 @@ const ANIMATION_FPS: u64 = 30; // 33 ms ~= 30fps
 
 pub const ANIMATION_SLEEP_MS: u64 = (1000.0 / ANIMATION_FPS as f32) as u64;
 
+const MAX_ANIMATION_FPS: u64 = 60; // For effects that want every frame they can get
+
+const MIN_FRAME_MS: u64 = (1000.0 / MAX_ANIMATION_FPS as f32) as u64;
+
 pub fn get_millis() -> u128 {
     SystemTime::now()
         .duration_since(UNIX_EPOCH)
@@ -21,18 +25,33 @@ pub struct EffectSave {
     name: String,
 }
 
+/// When an effect next needs to be updated
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum NextFrame {
+    /// Nothing changes until the effect is replaced
+    Never,
+    /// At this time (get_millis())
+    At(u128),
+    /// As soon as possible, up to MAX_ANIMATION_FPS
+    Asap,
+}
+
 /// Base effect trait.
-/// An effect is a lighting function that is updated 30 times per seonc
-/// in order to create an animation of some description on the laptop's
-/// keyboard
+/// An effect is a lighting function that is updated whenever it asks for
+/// a new frame, in order to create an animation of some description on
+/// the laptop's keyboard
 pub trait Effect: Send + Sync {
     /// Returns a new instance of an Effect
     fn new(args: Vec<u8>) -> Box<dyn Effect>
     where
         Self: Sized;
     /// Updates the keyboard, returning the current state of the keyboard
-    /// Called 30 times per second by the Effect Manager
+    /// Called by the Effect Manager when the effect said it needs a frame
     fn update(&mut self) -> board::KeyboardData;
+    /// Returns when the effect needs its next frame. Called right after update
+    fn next_frame(&self) -> NextFrame {
+        NextFrame::At(get_millis() + ANIMATION_SLEEP_MS as u128)
+    }
     /// Returns the arguments used to spawn the effect
     fn get_varargs(&mut self) -> &[u8];
     /// Returns the name of the effect (Unique identifier)
@@ -51,6 +70,10 @@ struct EffectLayer {
     /// Mask for keys
     key_mask: Vec<bool>,
     effect: Box<dyn Effect>,
+    /// Last frame of the effect
+    frame: board::KeyboardData,
+    /// When the effect needs its next frame
+    next_frame: NextFrame,
 }
 
 unsafe impl Send for EffectLayer {}
@@ -61,11 +84,23 @@ impl EffectLayer {
         return EffectLayer {
             key_mask: mask.to_vec(),
             effect,
+            frame: board::KeyboardData::new(),
+            next_frame: NextFrame::Asap,
         };
     }
 
-    fn update(&mut self) -> board::KeyboardData {
-        return self.effect.update();
+    /// Updates the effect if it is due, returns its current frame
+    fn update(&mut self, now: u128) -> board::KeyboardData {
+        let due = match self.next_frame {
+            NextFrame::Never => false,
+            NextFrame::At(t) => t <= now,
+            NextFrame::Asap => true,
+        };
+        if due {
+            self.frame = self.effect.update();
+            self.next_frame = self.effect.next_frame();
+        }
+        return self.frame;
     }
 
     fn get_save(&mut self) -> Option<serde_json::Value> {
@@ -110,6 +145,8 @@ impl EffectLayer {
         return Some(EffectLayer {
             key_mask,
             effect: effect.unwrap(),
+            frame: board::KeyboardData::new(),
+            next_frame: NextFrame::Asap,
         });
     }
 
@@ -124,7 +161,11 @@ impl EffectLayer {
 pub struct EffectManager {
     layers: Vec<EffectLayer>,
     last_update_ms: u128,
+    /// When update last ran
+    last_frame_ms: u128,
     render_board: board::KeyboardData,
+    /// Frame the keyboard is showing, None until one has been written
+    presented: Option<board::KeyboardData>,
 }
 
 unsafe impl Send for EffectManager {}
@@ -135,7 +176,9 @@ impl EffectManager {
         EffectManager {
             layers: vec![],
             last_update_ms: get_millis(),
+            last_frame_ms: get_millis(),
             render_board: board::KeyboardData::new(),
+            presented: None,
         }
     }
 
@@ -148,7 +191,22 @@ impl EffectManager {
         // If no more layers, erase keyboard rendering and set it to black
         if self.layers.len() == 0 {
             self.render_board.set_kbd_colour(0, 0, 0); 
-            self.render_board.update_kbd();
+            self.present();
+        }
+    }
+
+    /// Writes the keys of render_board that changed since the last frame
+    /// that made it to the keyboard. Nothing is written if none did
+    fn present(&mut self) {
+        let written = match self.presented {
+            Some(ref presented) if !self.render_board.differs_from(presented) => return,
+            Some(presented) => self.render_board.update_kbd_from(&presented),
+            None => self.render_board.update_kbd(),
+        };
+        // If the write failed, the whole difference is tried again next time
+        if written {
+            self.last_update_ms = get_millis();
+            self.presented = Some(self.render_board);
         }
     }
 
@@ -157,8 +215,10 @@ impl EffectManager {
         if self.layers.len() == 0 {
             return;
         }
+        let now = get_millis();
+        self.last_frame_ms = now;
         for layer in self.layers.iter_mut() {
-            let tmp_board = layer.update();
+            let tmp_board = layer.update(now);
             for (pos, state) in layer.key_mask.iter().enumerate() {
                 if *state == true {
                     self.render_board.set_key_at(pos, tmp_board.get_key_at(pos))
@@ -166,8 +226,20 @@ impl EffectManager {
             }
         }
         // Don't forget to actually render the board
-        self.last_update_ms = get_millis();
-        self.render_board.update_kbd();
+        self.present();
+    }
+
+    /// Returns when update next needs to be called (get_millis()), or None
+    /// if nothing changes until the effects do
+    pub fn next_deadline(&self) -> Option<u128> {
+        self.layers
+            .iter()
+            .filter_map(|l| match l.next_frame {
+                NextFrame::Never => None,
+                NextFrame::At(t) => Some(t),
+                NextFrame::Asap => Some(self.last_frame_ms + MIN_FRAME_MS as u128),
+            })
+            .min()
     }
 
     pub fn save(&mut self) -> serde_json::value::Value {